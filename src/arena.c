@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+
+// Allocations are rounded up to a cache line, so every block they come
+// from can be handed out exactly the same way after a reset.
+#define ARENA_ALIGN 64
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+// The word right before every allocation records where it came from: the
+// pointer calloc returned for heap memory, 0 for arena memory. Freeing
+// only has to look at the allocation itself, never at the arenas.
+#define ARENA_ORIGIN(p) (((void **)(p))[-1])
+// Arena allocations also record how many bytes of their block they took,
+// header included, so freeing the latest one can hand them back.
+#define ARENA_BYTES(p) (((size_t *)(p))[-2])
+
+typedef struct arena_block{
+    struct arena_block *next;
+    char *data;
+    size_t size, used;
+} arena_block;
+
+struct arena{
+    arena_block *blocks;
+    size_t min_size;
+    // Bytes in blocks, bytes of them in use, and the most ever in use
+    size_t size, used, peak;
+    int grows;
+};
+
+// Arena make_image and friends draw from on this thread, see use_arena.
+static __thread arena *current_arena = 0;
+
+static arena_block *arena_block_new(arena *a, size_t size)
+{
+    arena_block *b = malloc(sizeof(arena_block) + size + ARENA_ALIGN);
+    if(!b) return 0;
+    b->data = (char *)ARENA_ROUND((size_t)(b + 1));
+    b->size = size;
+    b->used = 0;
+    b->next = a->blocks;
+    a->blocks = b;
+    ++a->grows;
+    a->size += size;
+    return b;
+}
+
+// Make an arena: memory handed out by bumping a pointer through large
+// blocks and given back all at once by arena_reset, instead of one
+// malloc and free per image, matrix or descriptor.
+// size_t size: bytes in the first block, more blocks are added as needed.
+// returns: the arena, free with free_arena.
+arena *make_arena(size_t size)
+{
+    arena *a = calloc(1, sizeof(arena));
+    a->min_size = ARENA_ROUND(MAX(size, (size_t)ARENA_ALIGN));
+    arena_block_new(a, a->min_size);
+    a->grows = 0;
+    return a;
+}
+
+// Free an arena along with everything allocated from it. It must not be
+// in use on any thread.
+void free_arena(arena *a)
+{
+    if(!a) return;
+    while(a->blocks){
+        arena_block *b = a->blocks;
+        a->blocks = b->next;
+        free(b);
+    }
+    free(a);
+}
+
+// Give back everything allocated from an arena in one go. If it took more
+// than one block they are replaced by a single one that holds the most
+// that was ever in use at once, so running the same work again allocates
+// nothing.
+void arena_reset(arena *a)
+{
+    if(a->blocks && (a->blocks->next || a->blocks->size < a->peak)){
+        while(a->blocks){
+            arena_block *b = a->blocks;
+            a->blocks = b->next;
+            free(b);
+        }
+        a->size = 0;
+        arena_block_new(a, MAX(a->peak, a->min_size));
+    }
+    if(a->blocks) a->blocks->used = 0;
+    a->used = 0;
+}
+
+// Number of blocks an arena has had to malloc since it was made. Stays
+// put once the arena has grown to fit the work it is reset between.
+int arena_grows(arena *a)
+{
+    return a->grows;
+}
+
+// Bytes an arena holds in its blocks, used or not.
+size_t arena_size(arena *a)
+{
+    return a->size;
+}
+
+// Remember how far the arena in use on this thread has been filled, to
+// give back everything allocated after this point with arena_rewind.
+// returns: the position, does nothing when rewound if no arena is in use.
+arena_pos arena_mark()
+{
+    arena_pos p = {current_arena, 0, 0};
+    if(p.a && p.a->blocks){
+        p.block = p.a->blocks;
+        p.used = p.a->blocks->used;
+    }
+    return p;
+}
+
+// Give back everything allocated from an arena since a mark, so temporaries
+// of a stage or loop iteration cost their live size and not their sum.
+// Blocks added since the mark are freed. Nothing allocated after the mark may be used
+// afterwards, and the arena must not have been reset in between.
+// arena_pos p: position from arena_mark.
+void arena_rewind(arena_pos p)
+{
+    arena *a = p.a;
+    if(!a) return;
+    while(a->blocks && a->blocks != p.block){
+        arena_block *b = a->blocks;
+        a->blocks = b->next;
+        a->size -= b->size;
+        a->used -= b->used;
+        free(b);
+    }
+    if(a->blocks){
+        a->used -= a->blocks->used - p.used;
+        a->blocks->used = p.used;
+    }
+}
+
+// Make make_image, make_matrix and descriptor creation on this thread
+// draw from an arena. Everything allocated while it is in use lives until
+// the arena is rewound or reset, except the latest allocation, which
+// freeing hands back. It must not be freed after a rewind or reset past
+// it, since the memory then belongs to whatever comes next.
+// Other threads, including OpenMP workers, keep allocating from the heap.
+// arena *a: arena to allocate from, 0 for the heap.
+// returns: the arena that was in use before, to pass back when done.
+arena *use_arena(arena *a)
+{
+    arena *prev = current_arena;
+    current_arena = a;
+    return prev;
+}
+
+// Whether a pointer from arena_calloc was allocated from an arena.
+int arena_owns(const void *p)
+{
+    return p && !ARENA_ORIGIN(p);
+}
+
+// Zeroed memory like calloc, from the arena in use on this thread if there
+// is one. Either way it is aligned to 64 bytes for vector loads. Heap
+// memory still comes from calloc, over-allocated by a cache line to make
+// room for the alignment and the origin word, so large images keep
+// getting untouched zero pages from the system. Release it with
+// arena_free.
+void *arena_calloc(size_t n, size_t size)
+{
+    arena *a = current_arena;
+    if(!a){
+        char *base = calloc(n*size + ARENA_ALIGN + sizeof(void *), 1);
+        if(!base) return 0;
+        void *p = (void *)ARENA_ROUND((size_t)base + sizeof(void *));
+        ARENA_ORIGIN(p) = base;
+        return p;
+    }
+    size_t bytes = ARENA_ALIGN + ARENA_ROUND(n*size);
+    arena_block *b = a->blocks;
+    if(!b || b->size - b->used < bytes){
+        size_t grow = MAX(bytes, b ? 2*b->size : a->min_size);
+        b = arena_block_new(a, grow);
+        if(!b) return 0;
+    }
+    void *p = b->data + b->used + ARENA_ALIGN;
+    b->used += bytes;
+    a->used += bytes;
+    a->peak = MAX(a->peak, a->used);
+    ARENA_ORIGIN(p) = 0;
+    ARENA_BYTES(p) = bytes;
+    memset(p, 0, n*size);
+    return p;
+}
+
+// Free memory from arena_calloc. Arena memory is handed back right away if
+// it is the latest allocation of the arena in use on this thread, so
+// temporaries freed in reverse order don't pile up. Otherwise it is left
+// for arena_rewind or arena_reset.
+void arena_free(void *p)
+{
+    if(!p) return;
+    void *base = ARENA_ORIGIN(p);
+    if(base){
+        free(base);
+        return;
+    }
+    arena *a = current_arena;
+    arena_block *b = a ? a->blocks : 0;
+    size_t bytes = ARENA_BYTES(p);
+    if(b && (char *)p - ARENA_ALIGN + bytes == b->data + b->used){
+        b->used -= bytes;
+        a->used -= bytes;
+    }
+}
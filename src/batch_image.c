@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "image.h"
+
+// Slot states of an image_loader.
+#define LOADER_PENDING 0
+#define LOADER_LOADING 1
+#define LOADER_DONE 2
+#define LOADER_FAILED 3
+
+struct image_loader{
+    char **files;
+    int n;
+    int queue;
+    int next_job;
+    int next_out;
+    int stop;
+    image *ims;
+    int *state;
+    int nthreads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+};
+
+// Worker loop: claim the next file once there is room in the queue,
+// decode it outside the lock and hand it over.
+static void *loader_worker(void *arg)
+{
+    image_loader *l = arg;
+    pthread_mutex_lock(&l->lock);
+    while(1){
+        while(!l->stop && l->next_job < l->n && l->next_job >= l->next_out + l->queue){
+            pthread_cond_wait(&l->space, &l->lock);
+        }
+        if(l->stop || l->next_job >= l->n) break;
+        int i = l->next_job++;
+        l->state[i] = LOADER_LOADING;
+        pthread_mutex_unlock(&l->lock);
+
+        image im = {0};
+        int ok = try_load_image_stb(l->files[i], 0, &im);
+
+        pthread_mutex_lock(&l->lock);
+        l->ims[i] = im;
+        l->state[i] = ok ? LOADER_DONE : LOADER_FAILED;
+        pthread_cond_broadcast(&l->ready);
+    }
+    pthread_mutex_unlock(&l->lock);
+    return 0;
+}
+
+// Start loading a list of files in the background.
+// Files are decoded by a pool of threads, at most queue of them ahead of
+// what image_loader_next has handed out, so memory stays bounded however
+// long the list is. Images come back in list order, the first one as soon
+// as it is decoded.
+// char **files: paths to load, must outlive the loader.
+// int n: number of files.
+// int threads: number of decoding threads.
+// int queue: how many images may be decoded or decoding but not taken yet.
+// returns: the loader, free with free_image_loader.
+image_loader *make_image_loader(char **files, int n, int threads, int queue)
+{
+    assert(threads > 0 && queue > 0);
+    image_loader *l = calloc(1, sizeof(image_loader));
+    l->files = files;
+    l->n = n;
+    l->queue = queue;
+    l->ims = calloc(n, sizeof(image));
+    l->state = calloc(n, sizeof(int));
+    l->threads = calloc(threads, sizeof(pthread_t));
+    pthread_mutex_init(&l->lock, 0);
+    pthread_cond_init(&l->ready, 0);
+    pthread_cond_init(&l->space, 0);
+    int i;
+    for(i = 0; i < threads; ++i){
+        if(pthread_create(l->threads + i, 0, loader_worker, l)) break;
+    }
+    l->nthreads = i;
+    if(i == 0){
+        // No threads to be had, load everything on the caller's thread
+        l->queue = n;
+        loader_worker(l);
+    }
+    return l;
+}
+
+// Get the next image of a loader, waiting for it to be decoded.
+// image_loader *l: the loader.
+// image *im: filled in with the image, which the caller then owns, or
+//            with an empty image (data == 0) if the file failed to load.
+// returns: 1 if im was loaded, 0 if the file failed to load, -1 once every
+//          file has been handed out.
+int image_loader_next(image_loader *l, image *im)
+{
+    pthread_mutex_lock(&l->lock);
+    if(l->next_out >= l->n){
+        pthread_mutex_unlock(&l->lock);
+        return -1;
+    }
+    int i = l->next_out;
+    while(l->state[i] < LOADER_DONE) pthread_cond_wait(&l->ready, &l->lock);
+    int ok = l->state[i] == LOADER_DONE;
+    *im = l->ims[i];
+    l->ims[i].data = 0;
+    l->next_out++;
+    pthread_cond_broadcast(&l->space);
+    pthread_mutex_unlock(&l->lock);
+    return ok;
+}
+
+// Stop a loader and free it along with any images not taken yet.
+void free_image_loader(image_loader *l)
+{
+    pthread_mutex_lock(&l->lock);
+    l->stop = 1;
+    pthread_cond_broadcast(&l->space);
+    pthread_mutex_unlock(&l->lock);
+    int i;
+    for(i = 0; i < l->nthreads; ++i) pthread_join(l->threads[i], 0);
+    for(i = 0; i < l->n; ++i) free_image(l->ims[i]);
+    pthread_mutex_destroy(&l->lock);
+    pthread_cond_destroy(&l->ready);
+    pthread_cond_destroy(&l->space);
+    free(l->ims);
+    free(l->state);
+    free(l->threads);
+    free(l);
+}
+
+// Load a list of files with a pool of threads, see make_image_loader.
+// image *ims: n images to fill in, empty (data == 0) for files that failed.
+// returns: number of files that failed to load.
+int load_images(char **files, int n, int threads, image *ims)
+{
+    image_loader *l = make_image_loader(files, n, threads, MAX(threads, 1)*2);
+    int i, failed = 0;
+    for(i = 0; i < n; ++i) failed += image_loader_next(l, ims + i) != 1;
+    free_image_loader(l);
+    return failed;
+}
+
+// A queued write, see image_saver_submit.
+typedef struct{
+    image im;
+    char *name;
+    int png;
+} saver_job;
+
+struct image_saver{
+    saver_job *jobs;
+    int queue;
+    int head, count;
+    int busy;
+    int failed;
+    int stop;
+    int nthreads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t space;
+    pthread_cond_t idle;
+};
+
+// Worker loop: take the oldest job, encode and write it with this
+// thread's own writer so buffers are reused from one image to the next.
+static void *saver_worker(void *arg)
+{
+    image_saver *s = arg;
+    image_writer w = make_image_writer();
+    pthread_mutex_lock(&s->lock);
+    while(1){
+        while(!s->stop && s->count == 0) pthread_cond_wait(&s->work, &s->lock);
+        if(s->count == 0) break;
+        saver_job job = s->jobs[s->head];
+        s->head = (s->head + 1) % s->queue;
+        --s->count;
+        ++s->busy;
+        pthread_cond_signal(&s->space);
+        pthread_mutex_unlock(&s->lock);
+
+        int ok = write_image(&w, job.im, job.name, job.png);
+        free_image(job.im);
+        free(job.name);
+
+        pthread_mutex_lock(&s->lock);
+        --s->busy;
+        s->failed += !ok;
+        if(s->count == 0 && s->busy == 0) pthread_cond_broadcast(&s->idle);
+    }
+    pthread_mutex_unlock(&s->lock);
+    free_image_writer(&w);
+    return 0;
+}
+
+// Start threads that save images in the background.
+// int threads: number of encoding threads.
+// int queue: how many images may wait to be encoded before
+//            image_saver_submit blocks.
+// returns: the saver, free with free_image_saver.
+image_saver *make_image_saver(int threads, int queue)
+{
+    assert(threads > 0 && queue > 0);
+    image_saver *s = calloc(1, sizeof(image_saver));
+    s->jobs = calloc(queue, sizeof(saver_job));
+    s->queue = queue;
+    s->threads = calloc(threads, sizeof(pthread_t));
+    pthread_mutex_init(&s->lock, 0);
+    pthread_cond_init(&s->work, 0);
+    pthread_cond_init(&s->space, 0);
+    pthread_cond_init(&s->idle, 0);
+    int i;
+    for(i = 0; i < threads; ++i){
+        if(pthread_create(s->threads + i, 0, saver_worker, s)) break;
+    }
+    s->nthreads = i;
+    return s;
+}
+
+// Queue an image to be saved like save_image or save_png.
+// Waits only if the queue is full.
+// image_saver *s: the saver.
+// image im: image to save, the saver takes it over and frees it.
+// const char *name: file name without extension, copied.
+// int png: 1 for "<name>.png", 0 for "<name>.jpg".
+void image_saver_submit(image_saver *s, image im, const char *name, int png)
+{
+    saver_job job = {im, malloc(strlen(name) + 1), png};
+    strcpy(job.name, name);
+    if(s->nthreads == 0){
+        // No threads to be had, save on the caller's thread
+        image_writer w = make_image_writer();
+        int ok = write_image(&w, job.im, job.name, job.png);
+        free_image_writer(&w);
+        free_image(job.im);
+        free(job.name);
+        pthread_mutex_lock(&s->lock);
+        s->failed += !ok;
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    while(s->count == s->queue) pthread_cond_wait(&s->space, &s->lock);
+    s->jobs[(s->head + s->count) % s->queue] = job;
+    ++s->count;
+    pthread_cond_signal(&s->work);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Wait for every queued image to be written.
+// returns: number of images that failed to save since the last wait.
+int image_saver_wait(image_saver *s)
+{
+    pthread_mutex_lock(&s->lock);
+    while(s->count || s->busy) pthread_cond_wait(&s->idle, &s->lock);
+    int failed = s->failed;
+    s->failed = 0;
+    pthread_mutex_unlock(&s->lock);
+    return failed;
+}
+
+// Finish writing the queued images, then stop the threads and free the
+// saver.
+void free_image_saver(image_saver *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->work);
+    pthread_mutex_unlock(&s->lock);
+    int i;
+    for(i = 0; i < s->nthreads; ++i) pthread_join(s->threads[i], 0);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->work);
+    pthread_cond_destroy(&s->space);
+    pthread_cond_destroy(&s->idle);
+    free(s->jobs);
+    free(s->threads);
+    free(s);
+}
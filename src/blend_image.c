@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#include "matrix.h"
+
+// Number of pyramid levels for multi-band blending.
+#define BLEND_LEVELS 5
+// Rows of the overlap blended at a time, and extra rows of context above
+// and below each strip so the coarse levels see past the strip edges.
+// Both are multiples of 2^BLEND_LEVELS so every strip decimates on the
+// same grid.
+#define BLEND_STRIP 128
+#define BLEND_APRON 64
+
+// Blend two images band by band with a Laplacian pyramid.
+// image A, B: images to blend, same size.
+// image m: 1 channel weight of B at full resolution.
+// returns: blended image.
+static image multiband_blend(image A, image B, image m)
+{
+    image_pyramid pa = make_image_pyramid(A, BLEND_LEVELS+1);
+    image_pyramid pb = make_image_pyramid(B, BLEND_LEVELS+1);
+    image_pyramid pm = make_image_pyramid(m, BLEND_LEVELS+1);
+    int n = pa.levels-1;
+    #pragma omp parallel sections
+    {
+        #pragma omp section
+        pyramid_level(&pa, n);
+        #pragma omp section
+        pyramid_level(&pb, n);
+        #pragma omp section
+        pyramid_level(&pm, n);
+    }
+
+    // Levels don't depend on each other once the Gaussian pyramids exist
+    image lap[BLEND_LEVELS+1];
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i <= n; ++i){
+        image ga = pa.level[i], gb = pb.level[i], gm = pm.level[i];
+        image la = i < n ? pyramid_expand(pa.level[i+1], ga.w, ga.h) : make_image(ga.w, ga.h, ga.c);
+        image lb = i < n ? pyramid_expand(pb.level[i+1], gb.w, gb.h) : make_image(gb.w, gb.h, gb.c);
+        int size = la.w*la.h;
+        int j, k;
+        for(k = 0; k < la.c; ++k){
+            float *da = la.data + k*size, *db = lb.data + k*size;
+            const float *a = ga.data + k*size, *b = gb.data + k*size;
+            for(j = 0; j < size; ++j){
+                float w = gm.data[j];
+                da[j] = (1-w)*(a[j] - da[j]) + w*(b[j] - db[j]);
+            }
+        }
+        free_image(lb);
+        lap[i] = la;
+    }
+    free_image_pyramid(pa);
+    free_image_pyramid(pb);
+    free_image_pyramid(pm);
+
+    image out = lap[n];
+    for(i = n-1; i >= 0; --i){
+        image up = pyramid_expand(out, lap[i].w, lap[i].h);
+        int j;
+        for(j = 0; j < up.w*up.h*up.c; ++j) lap[i].data[j] += up.data[j];
+        free_image(up);
+        free_image(out);
+        out = lap[i];
+    }
+    return out;
+}
+
+// Stitches two images together like combine_images, but blends the seam.
+// Only the rectangle where a and the footprint of b overlap is blended, in
+// strips of BLEND_STRIP rows, so memory follows the width of the overlap
+// and not the size of the panorama.
+// image a, b: images to stitch.
+// matrix H: homography from image a coordinates to image b coordinates.
+// int mode: BLEND_OVERWRITE, BLEND_FEATHER or BLEND_MULTIBAND.
+// returns: combined image stitched together.
+image combine_images_blend(image a, image b, matrix H, int mode)
+{
+    int dx, dy, w, h;
+    combine_extent(a, b, H, &dx, &dy, &w, &h);
+    image c = combine_images(a, b, H);
+    if(mode == BLEND_OVERWRITE || c.w != w || c.h != h) return c;
+
+    // Footprint of b on the canvas. Weights are the exact distance
+    // transform of each footprint: for a convex quad that is the distance
+    // to the nearest edge line.
+    matrix Hinv = matrix_invert(H);
+    point q[4];
+    q[0] = project_point(Hinv, make_point(0, 0));
+    q[1] = project_point(Hinv, make_point(b.w-1, 0));
+    q[2] = project_point(Hinv, make_point(b.w-1, b.h-1));
+    q[3] = project_point(Hinv, make_point(0, b.h-1));
+    free_matrix(Hinv);
+    float en[4][3];
+    float area = 0;
+    int i, j, k;
+    for(i = 0; i < 4; ++i){
+        point p0 = q[i], p1 = q[(i+1)%4];
+        area += p0.x*p1.y - p1.x*p0.y;
+    }
+    for(i = 0; i < 4; ++i){
+        point p0 = q[i], p1 = q[(i+1)%4];
+        float ex = p1.x - p0.x, ey = p1.y - p0.y;
+        float len = sqrtf(ex*ex + ey*ey);
+        if(len == 0) return c;
+        float s = area > 0 ? 1 : -1;
+        // signed distance of (x, y) in a coordinates is en[0]*x + en[1]*y + en[2]
+        en[i][0] = -s*ey/len;
+        en[i][1] = s*ex/len;
+        en[i][2] = s*(ey*p0.x - ex*p0.y)/len;
+    }
+
+    // Overlap of a's rectangle and b's bounding box, in canvas coordinates
+    int rx0 = MAX(-dx, (int)floorf(MIN(MIN(q[0].x, q[1].x), MIN(q[2].x, q[3].x))) - dx);
+    int ry0 = MAX(-dy, (int)floorf(MIN(MIN(q[0].y, q[1].y), MIN(q[2].y, q[3].y))) - dy);
+    int rx1 = MIN(a.w - dx, (int)ceilf(MAX(MAX(q[0].x, q[1].x), MAX(q[2].x, q[3].x))) + 1 - dx);
+    int ry1 = MIN(a.h - dy, (int)ceilf(MAX(MAX(q[0].y, q[1].y), MAX(q[2].y, q[3].y))) + 1 - dy);
+    rx1 = MIN(rx1, w);
+    ry1 = MIN(ry1, h);
+    if(rx0 >= rx1 || ry0 >= ry1) return c;
+    int rw = rx1 - rx0;
+    int apron = mode == BLEND_MULTIBAND ? BLEND_APRON : 0;
+
+    int y0;
+    for(y0 = ry0; y0 < ry1; y0 += BLEND_STRIP){
+        int e0 = MAX(ry0, y0 - apron);
+        int e1 = MIN(ry1, y0 + BLEND_STRIP + apron);
+        int sh = e1 - e0;
+        image A = make_image(rw, sh, c.c);
+        image B = make_image(rw, sh, c.c);
+        image m = make_image(rw, sh, 1);
+        image valid = make_image(rw, sh, 1);
+        warp_rect(b, H, B.data, rw, rw*sh, valid.data, rx0+dx, e0+dy, rw, sh);
+        for(k = 0; k < c.c; ++k){
+            for(j = 0; j < sh; ++j){
+                memcpy(A.data + k*rw*sh + j*rw, &IMAGE_AT(a, rx0+dx, e0+dy+j, k), rw*sizeof(float));
+            }
+        }
+        for(j = 0; j < sh; ++j){
+            int ay = e0 + dy + j;
+            for(i = 0; i < rw; ++i){
+                int ax = rx0 + dx + i;
+                int idx = j*rw + i;
+                float da = MIN(MIN(ax, a.w-1-ax), MIN(ay, a.h-1-ay)) + .5f;
+                float db = en[0][0]*ax + en[0][1]*ay + en[0][2];
+                for(k = 1; k < 4; ++k) db = MIN(db, en[k][0]*ax + en[k][1]*ay + en[k][2]);
+                db = MAX(db, 0) + .5f;
+                if(!valid.data[idx]){
+                    m.data[idx] = 0;
+                    for(k = 0; k < c.c; ++k) B.data[k*rw*sh + idx] = A.data[k*rw*sh + idx];
+                } else if(mode == BLEND_FEATHER){
+                    m.data[idx] = db/(da + db);
+                } else {
+                    m.data[idx] = db > da;
+                }
+            }
+        }
+
+        image out;
+        if(mode == BLEND_MULTIBAND){
+            out = multiband_blend(A, B, m);
+        } else {
+            out = make_image(rw, sh, c.c);
+            for(k = 0; k < c.c; ++k){
+                for(i = 0; i < rw*sh; ++i){
+                    float wb = m.data[i];
+                    out.data[k*rw*sh + i] = (1-wb)*A.data[k*rw*sh + i] + wb*B.data[k*rw*sh + i];
+                }
+            }
+        }
+
+        int r0 = y0 - e0;
+        int r1 = MIN(y0 + BLEND_STRIP, ry1) - e0;
+        for(k = 0; k < c.c; ++k){
+            for(j = r0; j < r1; ++j){
+                memcpy(c.data + k*w*h + (e0+j)*w + rx0, out.data + k*rw*sh + j*rw, rw*sizeof(float));
+            }
+        }
+        free_image(out);
+        free_image(A);
+        free_image(B);
+        free_image(m);
+        free_image(valid);
+    }
+    return c;
+}
@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "image.h"
+
+// Make a tiled canvas. Tiles are CANVAS_TILE x CANVAS_TILE pixels with all
+// channels of a tile stored together, and are only allocated the first time
+// something asks for them.
+// int w, h, c: size of the canvas.
+// const char *scratch: if not NULL, tiles live in a memory-mapped file at
+//                      this path instead of the heap, so the kernel can page
+//                      them out. The file is removed right away and only
+//                      takes disk space for tiles that were written.
+// returns: the canvas, with tiles == 0 if it could not be created.
+canvas make_canvas(int w, int h, int c, const char *scratch)
+{
+    canvas cv = {0};
+    cv.w = w;
+    cv.h = h;
+    cv.c = c;
+    cv.tw = (w + CANVAS_TILE - 1)/CANVAS_TILE;
+    cv.th = (h + CANVAS_TILE - 1)/CANVAS_TILE;
+    cv.fd = -1;
+    size_t n = (size_t)cv.tw*cv.th;
+    size_t bytes = n*CANVAS_TILE*CANVAS_TILE*c*sizeof(float);
+    if(scratch){
+        int fd = open(scratch, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if(fd < 0){
+            fprintf(stderr, "Cannot create canvas scratch file %s\n", scratch);
+            return cv;
+        }
+        unlink(scratch);
+        void *map = MAP_FAILED;
+        if(ftruncate(fd, bytes) == 0){
+            map = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if(map == MAP_FAILED){
+            fprintf(stderr, "Cannot map canvas scratch file %s\n", scratch);
+            close(fd);
+            return cv;
+        }
+        cv.fd = fd;
+        cv.map = map;
+    }
+    cv.tiles = calloc(n, sizeof(float *));
+    return cv;
+}
+
+void free_canvas(canvas cv)
+{
+    size_t n = (size_t)cv.tw*cv.th;
+    size_t i;
+    if(cv.map){
+        munmap(cv.map, n*CANVAS_TILE*CANVAS_TILE*cv.c*sizeof(float));
+        close(cv.fd);
+    } else if(cv.tiles){
+        for(i = 0; i < n; ++i) free(cv.tiles[i]);
+    }
+    free(cv.tiles);
+}
+
+// Get a tile of the canvas for writing, allocating it if needed.
+// Different tiles can be requested from different threads at the same time.
+// int tx, ty: tile coordinates.
+// returns: CANVAS_TILE*CANVAS_TILE*c floats, channel-planar.
+float *canvas_tile(canvas cv, int tx, int ty)
+{
+    size_t t = (size_t)ty*cv.tw + tx;
+    size_t size = (size_t)CANVAS_TILE*CANVAS_TILE*cv.c;
+    if(!cv.tiles[t]){
+        if(cv.map) cv.tiles[t] = cv.map + t*size;
+        else cv.tiles[t] = calloc(size, sizeof(float));
+    }
+    return cv.tiles[t];
+}
+
+// Copy an image onto the canvas.
+// image im: image to paste, should have at most cv.c channels.
+// int x, y: canvas position of the top left corner of im.
+void canvas_paste(canvas cv, image im, int x, int y)
+{
+    assert(im.c <= cv.c);
+    int x0 = MAX(0, x);
+    int y0 = MAX(0, y);
+    int x1 = MIN(cv.w, x + im.w);
+    int y1 = MIN(cv.h, y + im.h);
+    if(x0 >= x1 || y0 >= y1) return;
+    int tx, ty, j, k;
+    for(ty = y0/CANVAS_TILE; ty <= (y1-1)/CANVAS_TILE; ++ty){
+        for(tx = x0/CANVAS_TILE; tx <= (x1-1)/CANVAS_TILE; ++tx){
+            float *tile = canvas_tile(cv, tx, ty);
+            int cx0 = MAX(x0, tx*CANVAS_TILE);
+            int cx1 = MIN(x1, (tx+1)*CANVAS_TILE);
+            int cy0 = MAX(y0, ty*CANVAS_TILE);
+            int cy1 = MIN(y1, (ty+1)*CANVAS_TILE);
+            for(k = 0; k < im.c; ++k){
+                for(j = cy0; j < cy1; ++j){
+                    memcpy(tile + k*CANVAS_TILE*CANVAS_TILE + (j - ty*CANVAS_TILE)*CANVAS_TILE + cx0 - tx*CANVAS_TILE,
+                            &IMAGE_AT(im, cx0 - x, j - y, k),
+                            (cx1 - cx0)*sizeof(float));
+                }
+            }
+        }
+    }
+}
+
+// Read one row of one channel of the canvas. Unwritten tiles read as 0.
+// int y: row to read.
+// int c: channel to read.
+// float *row: cv.w floats to fill in.
+void canvas_get_row(canvas cv, int y, int c, float *row)
+{
+    int ty = y/CANVAS_TILE;
+    int tx;
+    for(tx = 0; tx < cv.tw; ++tx){
+        int n = MIN(CANVAS_TILE, cv.w - tx*CANVAS_TILE);
+        float *tile = cv.tiles[(size_t)ty*cv.tw + tx];
+        if(tile){
+            memcpy(row + tx*CANVAS_TILE,
+                    tile + c*CANVAS_TILE*CANVAS_TILE + (y - ty*CANVAS_TILE)*CANVAS_TILE,
+                    n*sizeof(float));
+        } else {
+            memset(row + tx*CANVAS_TILE, 0, n*sizeof(float));
+        }
+    }
+}
+
+// Flatten a canvas into a regular image.
+// returns: w x h x c image with the contents of the canvas.
+image canvas_to_image(canvas cv)
+{
+    image im = make_image(cv.w, cv.h, cv.c);
+    int j, k;
+    for(k = 0; k < cv.c; ++k){
+        for(j = 0; j < cv.h; ++j){
+            canvas_get_row(cv, j, k, im.data + (size_t)k*cv.w*cv.h + (size_t)j*cv.w);
+        }
+    }
+    return im;
+}
+
+// Write a canvas to disk as a binary PPM (3 channels) or PGM (1 channel),
+// one row at a time, so saving never needs a full frame in memory.
+// const char *name: file name without the extension.
+void save_canvas(canvas cv, const char *name)
+{
+    assert(cv.c == 1 || cv.c == 3);
+    char buff[256];
+    snprintf(buff, sizeof(buff), "%s.%s", name, cv.c == 3 ? "ppm" : "pgm");
+    FILE *fp = fopen(buff, "wb");
+    if(!fp){
+        fprintf(stderr, "Failed to write image %s\n", buff);
+        return;
+    }
+    fprintf(fp, "P%d\n%d %d\n255\n", cv.c == 3 ? 6 : 5, cv.w, cv.h);
+    float *row = calloc(cv.w, sizeof(float));
+    unsigned char *out = calloc(cv.w*cv.c, sizeof(unsigned char));
+    int i, j, k;
+    for(j = 0; j < cv.h; ++j){
+        for(k = 0; k < cv.c; ++k){
+            canvas_get_row(cv, j, k, row);
+            for(i = 0; i < cv.w; ++i){
+                float v = row[i] < 0 ? 0 : (row[i] > 1 ? 1 : row[i]);
+                out[i*cv.c + k] = (unsigned char) roundf(255*v);
+            }
+        }
+        fwrite(out, 1, cv.w*cv.c, fp);
+    }
+    free(row);
+    free(out);
+    if(fclose(fp)) fprintf(stderr, "Failed to write image %s\n", buff);
+}
+
+static void canvas_get_row_source(void *data, int y, int c, float *row)
+{
+    canvas_get_row(*(canvas *)data, y, c, row);
+}
+
+// Rows of a canvas, for the streaming encoders.
+// canvas *cv: canvas to read, must outlive the source.
+row_source canvas_rows(canvas *cv)
+{
+    row_source src = {cv->w, cv->h, cv->c, cv, canvas_get_row_source};
+    return src;
+}
+
+// Write a canvas to disk as a compressed PNG or JPEG. Like save_canvas it
+// works a few rows at a time, the canvas is never flattened.
+// const char *name: file name without the extension.
+// int png: 1 for "<name>.png", 0 for "<name>.jpg".
+// returns: 1 on success, 0 if the file could not be written.
+int save_canvas_image(canvas cv, const char *name, int png)
+{
+    return save_rows(canvas_rows(&cv), name, png);
+}
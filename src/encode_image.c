@@ -0,0 +1,1171 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include "image.h"
+
+// Streaming PNG and JPEG encoders. Pixels are pulled from a row_source a
+// few rows at a time and compressed straight to the file, so saving never
+// needs an interleaved copy of the whole image the way stb's writers do.
+
+static void image_get_row(void *data, int y, int c, float *row)
+{
+    image *im = data;
+    memcpy(row, &IMAGE_AT(*im, 0, y, c), im->w*sizeof(float));
+}
+
+// Rows of an image, for the streaming encoders.
+// image *im: image to read, must outlive the source.
+row_source image_rows(image *im)
+{
+    row_source src = {im->w, im->h, im->c, im, image_get_row};
+    return src;
+}
+
+// Fetch one row of every channel and convert it to interleaved 8-bit
+// pixels, clamped and rounded like save_image.
+// float *tmp: src.w*src.c floats of scratch.
+// unsigned char *out: src.w*src.c bytes to fill in.
+static void row_u8(row_source src, int y, float *tmp, unsigned char *out)
+{
+    int i, k;
+    for(k = 0; k < src.c; ++k){
+        float *row = tmp + k*src.w;
+        src.get_row(src.data, y, k, row);
+        for(i = 0; i < src.w; ++i) out[i*src.c + k] = (unsigned char)(MIN(MAX(row[i], 0.f), 1.f)*255 + .5f);
+    }
+}
+
+// Deflate (RFC 1951) inside a zlib wrapper (RFC 1950), fed incrementally.
+// Input goes through a sliding buffer that keeps the last DEFLATE_WINDOW
+// bytes as history. Matches come from hash chains over 3 byte prefixes,
+// searched as hard as the level asks, and every block is coded with
+// whichever of dynamic Huffman, fixed Huffman or stored is smallest.
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_BUFFER (4*DEFLATE_WINDOW)
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_LOOKAHEAD (DEFLATE_MAX_MATCH + 3)
+// Symbols per block, every block gets its own Huffman codes.
+#define DEFLATE_BLOCK 16384
+
+// How hard each compression level looks for matches, the same trade offs
+// as zlib's levels.
+// int good: once a match is this long, search the next byte less hard.
+// int lazy: check whether the next byte starts a longer match, unless the
+//           match is already this long. 0 takes every match right away.
+// int nice: stop searching once a match is this long.
+// int chain: hash chain candidates to try.
+typedef struct{
+    int good, lazy, nice, chain;
+} deflate_level;
+static const deflate_level deflate_levels[10] = {
+    {0, 0, 0, 0}, {4, 0, 8, 4}, {4, 0, 16, 8}, {4, 0, 32, 32}, {4, 4, 16, 16},
+    {8, 16, 32, 32}, {8, 16, 128, 128}, {8, 32, 128, 256}, {32, 128, 258, 1024}, {32, 258, 258, 4096}};
+
+static const unsigned short deflate_len_base[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,
+    35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const unsigned char deflate_len_extra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const unsigned short deflate_dist_base[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+    257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const unsigned char deflate_dist_extra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+// Order the code length code lengths are sent in.
+static const unsigned char deflate_cl_order[19] = {16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
+
+// Matches are stored as DEFLATE_MATCH | length << 16 | distance.
+#define DEFLATE_MATCH 0x80000000u
+
+typedef struct{
+    deflate_level lv;
+    int stored;
+    unsigned char *buf;
+    int pos, end;
+    int *head, *prev;
+    unsigned int *syms;
+    int nsyms;
+    int block_start;
+    unsigned int lit_freq[286], dist_freq[30];
+    unsigned long long bits;
+    int nbits;
+    unsigned char *out;
+    size_t out_len, out_cap;
+    unsigned int adler_a, adler_b;
+    size_t total_in;
+    unsigned short fixed_code[288], fixed_dcode[30];
+    unsigned char fixed_len[288], fixed_dlen[30];
+} deflater;
+
+static unsigned int reverse_bits(unsigned int v, int n)
+{
+    unsigned int r = 0;
+    int i;
+    for(i = 0; i < n; ++i){
+        r = (r << 1) | (v & 1);
+        v >>= 1;
+    }
+    return r;
+}
+
+static void deflate_bits(deflater *d, unsigned int v, int n)
+{
+    d->bits |= (unsigned long long)v << d->nbits;
+    d->nbits += n;
+    if(d->out_len + 8 > d->out_cap){
+        d->out_cap = d->out_cap*2 + 8;
+        d->out = realloc(d->out, d->out_cap);
+    }
+    while(d->nbits >= 8){
+        d->out[d->out_len++] = d->bits & 255;
+        d->bits >>= 8;
+        d->nbits -= 8;
+    }
+}
+
+// Pad to a byte boundary with 0 bits.
+static void deflate_align(deflater *d)
+{
+    if(d->nbits) deflate_bits(d, 0, 8 - d->nbits);
+}
+
+// Huffman code lengths for symbol frequencies, at most limit bits long.
+// When the tree comes out too deep the frequencies are flattened and the
+// tree rebuilt, which costs a little compression in the rare blocks that
+// need it.
+static void huffman_lengths(const unsigned int *freq, int n, int limit, unsigned char *len)
+{
+    unsigned int f[286];
+    unsigned long long weight[2*286];
+    int parent[2*286], alive[2*286];
+    int leaf[286];
+    int i, nleaves = 0;
+    memset(len, 0, n);
+    for(i = 0; i < n; ++i){
+        f[i] = freq[i];
+        if(f[i]) leaf[nleaves++] = i;
+    }
+    if(nleaves == 0) return;
+    if(nleaves == 1){
+        // A code needs two symbols to be complete, add a dummy one
+        len[leaf[0]] = 1;
+        len[leaf[0] ? 0 : 1] = 1;
+        return;
+    }
+    while(1){
+        int nodes = nleaves, left = nleaves;
+        for(i = 0; i < nleaves; ++i){
+            weight[i] = f[leaf[i]];
+            parent[i] = -1;
+            alive[i] = 1;
+        }
+        while(left > 1){
+            int a = -1, b = -1;
+            for(i = 0; i < nodes; ++i){
+                if(!alive[i]) continue;
+                if(a < 0 || weight[i] < weight[a]){
+                    b = a;
+                    a = i;
+                } else if(b < 0 || weight[i] < weight[b]){
+                    b = i;
+                }
+            }
+            weight[nodes] = weight[a] + weight[b];
+            parent[nodes] = -1;
+            alive[nodes] = 1;
+            parent[a] = parent[b] = nodes;
+            alive[a] = alive[b] = 0;
+            ++nodes;
+            --left;
+        }
+        int deepest = 0;
+        for(i = 0; i < nleaves; ++i){
+            int depth = 0, p = i;
+            while(parent[p] >= 0){
+                p = parent[p];
+                ++depth;
+            }
+            len[leaf[i]] = depth;
+            deepest = MAX(deepest, depth);
+        }
+        if(deepest <= limit) return;
+        for(i = 0; i < nleaves; ++i) f[leaf[i]] = (f[leaf[i]] + 1)/2;
+    }
+}
+
+// Canonical codes for a set of code lengths, bit reversed since deflate
+// sends Huffman codes starting from the most significant bit.
+static void huffman_codes(const unsigned char *len, int n, unsigned short *code)
+{
+    int count[16] = {0}, next[16] = {0};
+    int i, bits, c = 0;
+    for(i = 0; i < n; ++i) ++count[len[i]];
+    count[0] = 0;
+    for(bits = 1; bits < 16; ++bits){
+        c = (c + count[bits-1]) << 1;
+        next[bits] = c;
+    }
+    for(i = 0; i < n; ++i) code[i] = len[i] ? reverse_bits(next[len[i]]++, len[i]) : 0;
+}
+
+static inline int deflate_len_code(int len)
+{
+    if(len <= 10) return len - 3;
+    if(len == 258) return 28;
+    int l = len - 3;
+    int nb = 31 - __builtin_clz(l);
+    return 4*(nb - 1) + ((l >> (nb - 2)) & 3);
+}
+
+static inline int deflate_dist_code(int dist)
+{
+    int v = dist - 1;
+    if(v < 4) return v;
+    int nb = 31 - __builtin_clz(v);
+    return 2*nb + ((v >> (nb - 1)) & 1);
+}
+
+// Make a compressor.
+// int level: 0 for stored blocks only, 1 fastest to 9 smallest.
+// int header: start the output with a zlib header.
+static deflater make_deflater(int level, int header)
+{
+    static const unsigned char flevel[10] = {0x01, 0x01, 0x5e, 0x5e, 0x5e, 0x5e, 0x9c, 0xda, 0xda, 0xda};
+    level = MIN(MAX(level, 0), 9);
+    deflater d;
+    memset(&d, 0, sizeof(d));
+    d.lv = deflate_levels[level];
+    d.stored = level == 0;
+    d.buf = malloc(DEFLATE_BUFFER);
+    d.head = malloc((1 << DEFLATE_HASH_BITS)*sizeof(int));
+    d.prev = malloc(DEFLATE_BUFFER*sizeof(int));
+    d.syms = malloc(DEFLATE_BLOCK*sizeof(unsigned int));
+    memset(d.head, -1, (1 << DEFLATE_HASH_BITS)*sizeof(int));
+    d.adler_a = 1;
+    int s;
+    for(s = 0; s < 288; ++s) d.fixed_len[s] = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8;
+    for(s = 0; s < 30; ++s) d.fixed_dlen[s] = 5;
+    huffman_codes(d.fixed_len, 288, d.fixed_code);
+    huffman_codes(d.fixed_dlen, 30, d.fixed_dcode);
+    if(header){
+        // 32K window, FCHECK makes the pair a multiple of 31
+        deflate_bits(&d, 0x78, 8);
+        deflate_bits(&d, flevel[level], 8);
+    }
+    return d;
+}
+
+static void free_deflater(deflater *d)
+{
+    free(d->buf);
+    free(d->head);
+    free(d->prev);
+    free(d->syms);
+    free(d->out);
+}
+
+static inline unsigned int deflate_hash(const unsigned char *p)
+{
+    unsigned int v = (p[0] << 16) | (p[1] << 8) | p[2];
+    return (v*2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+static inline void deflate_insert(deflater *d, int i)
+{
+    if(i + 3 > d->end) return;
+    unsigned int h = deflate_hash(d->buf + i);
+    d->prev[i] = d->head[h];
+    d->head[h] = i;
+}
+
+static inline void deflate_literal(deflater *d, int c)
+{
+    d->syms[d->nsyms++] = c;
+    ++d->lit_freq[c];
+}
+
+static inline void deflate_match(deflater *d, int len, int dist)
+{
+    d->syms[d->nsyms++] = DEFLATE_MATCH | len << 16 | dist;
+    ++d->lit_freq[257 + deflate_len_code(len)];
+    ++d->dist_freq[deflate_dist_code(dist)];
+}
+
+// Length of the common prefix of a and b, up to max bytes, compared a
+// word at a time.
+static inline int match_length(const unsigned char *a, const unsigned char *b, int max)
+{
+    int len = 0;
+    while(len + 8 <= max){
+        unsigned long long x, y;
+        memcpy(&x, a + len, 8);
+        memcpy(&y, b + len, 8);
+        if(x != y) return len + (__builtin_ctzll(x ^ y) >> 3);
+        len += 8;
+    }
+    while(len < max && a[len] == b[len]) ++len;
+    return len;
+}
+
+// Longest match for the bytes at p within the window.
+// int chain: hash chain candidates to try.
+// returns: match length, 0 if there is none of at least 3 bytes.
+static int deflate_find(deflater *d, int p, int chain, int *dist)
+{
+    int avail = MIN(DEFLATE_MAX_MATCH, d->end - p);
+    if(avail < 3 || !chain) return 0;
+    int nice = MIN(d->lv.nice, avail);
+    const unsigned char *b = d->buf + p;
+    int cand = d->head[deflate_hash(b)];
+    int best = 0;
+    while(cand >= 0 && p - cand <= DEFLATE_WINDOW && chain--){
+        const unsigned char *a = d->buf + cand;
+        if(a[best] == b[best] && a[0] == b[0]){
+            int len = match_length(a, b, avail);
+            if(len > best){
+                best = len;
+                *dist = p - cand;
+                if(len >= nice) break;
+            }
+        }
+        cand = d->prev[cand];
+    }
+    return best >= 3 ? best : 0;
+}
+
+// Send the symbols of a block with the given codes, then end of block.
+static void deflate_symbols(deflater *d, const unsigned short *lcode, const unsigned char *llen,
+        const unsigned short *dcode, const unsigned char *dlen)
+{
+    int i;
+    for(i = 0; i < d->nsyms; ++i){
+        unsigned int s = d->syms[i];
+        if(!(s & DEFLATE_MATCH)){
+            deflate_bits(d, lcode[s], llen[s]);
+            continue;
+        }
+        int len = (s >> 16) & 0x1ff, dist = s & 0xffff;
+        int lc = deflate_len_code(len), dc = deflate_dist_code(dist);
+        deflate_bits(d, lcode[257 + lc], llen[257 + lc]);
+        if(deflate_len_extra[lc]) deflate_bits(d, len - deflate_len_base[lc], deflate_len_extra[lc]);
+        deflate_bits(d, dcode[dc], dlen[dc]);
+        if(deflate_dist_extra[dc]) deflate_bits(d, dist - deflate_dist_base[dc], deflate_dist_extra[dc]);
+    }
+    deflate_bits(d, lcode[256], llen[256]);
+}
+
+// Bits the symbols of a block take with the given code lengths.
+static size_t deflate_cost(const deflater *d, const unsigned char *llen, const unsigned char *dlen)
+{
+    size_t bits = 0;
+    int i;
+    for(i = 0; i < 286; ++i) bits += (size_t)d->lit_freq[i]*(llen[i] + (i > 256 ? deflate_len_extra[i-257] : 0));
+    for(i = 0; i < 30; ++i) bits += (size_t)d->dist_freq[i]*(dlen[i] + deflate_dist_extra[i]);
+    return bits;
+}
+
+// Run length code a list of code lengths with symbols 16 (repeat the
+// previous length), 17 and 18 (runs of zeros).
+// unsigned short *rle: filled with symbol | extra bits << 8.
+// returns: number of symbols.
+static int deflate_rle(const unsigned char *len, int n, unsigned short *rle)
+{
+    int i = 0, m = 0, prev = -1;
+    while(i < n){
+        int v = len[i], run = 1;
+        while(i + run < n && len[i+run] == v) ++run;
+        if(v == 0 && run >= 3){
+            int r = MIN(run, 138);
+            rle[m++] = r >= 11 ? 18 | (r - 11) << 8 : 17 | (r - 3) << 8;
+            i += r;
+        } else if(v == prev && run >= 3){
+            int r = MIN(run, 6);
+            rle[m++] = 16 | (r - 3) << 8;
+            i += r;
+        } else {
+            rle[m++] = v;
+            ++i;
+        }
+        prev = v;
+    }
+    return m;
+}
+
+static void deflate_stored(deflater *d, const unsigned char *data, int n, int final)
+{
+    do{
+        int m = MIN(n, 65535);
+        n -= m;
+        deflate_bits(d, final && n == 0, 1);
+        deflate_bits(d, 0, 2);
+        deflate_align(d);
+        deflate_bits(d, m & 255, 8);
+        deflate_bits(d, m >> 8, 8);
+        deflate_bits(d, ~m & 255, 8);
+        deflate_bits(d, (~m >> 8) & 255, 8);
+        if(d->out_len + m > d->out_cap){
+            d->out_cap = d->out_len + m + d->out_cap;
+            d->out = realloc(d->out, d->out_cap);
+        }
+        // A sync flush writes an empty block with data == 0
+        if(m){
+            memcpy(d->out + d->out_len, data, m);
+            d->out_len += m;
+            data += m;
+        }
+    } while(n > 0);
+}
+
+// Code the symbols gathered since the last block, covering the input from
+// block_start to pos.
+static void deflate_block(deflater *d, int final)
+{
+    int raw = d->pos - d->block_start;
+    d->lit_freq[256] = 1;
+    unsigned char llen[286], dlen[30], cllen[19];
+    unsigned short lcode[286], dcode[30], clcode[19];
+    unsigned short rle[286 + 30];
+    unsigned char lens[286 + 30];
+    huffman_lengths(d->lit_freq, 286, 15, llen);
+    huffman_lengths(d->dist_freq, 30, 15, dlen);
+    int nlit = 286, ndist = 30, i;
+    while(nlit > 257 && !llen[nlit-1]) --nlit;
+    while(ndist > 1 && !dlen[ndist-1]) --ndist;
+    memcpy(lens, llen, nlit);
+    memcpy(lens + nlit, dlen, ndist);
+    int nrle = deflate_rle(lens, nlit + ndist, rle);
+    unsigned int clfreq[19] = {0};
+    for(i = 0; i < nrle; ++i) ++clfreq[rle[i] & 255];
+    huffman_lengths(clfreq, 19, 7, cllen);
+    int ncl = 19;
+    while(ncl > 4 && !cllen[deflate_cl_order[ncl-1]]) --ncl;
+
+    size_t dynamic = 17 + 3*ncl + deflate_cost(d, llen, dlen);
+    for(i = 0; i < nrle; ++i){
+        int s = rle[i] & 255;
+        dynamic += cllen[s] + (s == 16 ? 2 : s == 17 ? 3 : s == 18 ? 7 : 0);
+    }
+    size_t fixed = 3 + deflate_cost(d, d->fixed_len, d->fixed_dlen);
+    size_t stored = (size_t)8*raw + 48*(raw/65535 + 1);
+
+    if(d->stored || (stored <= fixed && stored <= dynamic)){
+        deflate_stored(d, d->buf + d->block_start, raw, final);
+    } else if(fixed <= dynamic){
+        deflate_bits(d, final, 1);
+        deflate_bits(d, 1, 2);
+        deflate_symbols(d, d->fixed_code, d->fixed_len, d->fixed_dcode, d->fixed_dlen);
+    } else {
+        huffman_codes(llen, 286, lcode);
+        huffman_codes(dlen, 30, dcode);
+        huffman_codes(cllen, 19, clcode);
+        deflate_bits(d, final, 1);
+        deflate_bits(d, 2, 2);
+        deflate_bits(d, nlit - 257, 5);
+        deflate_bits(d, ndist - 1, 5);
+        deflate_bits(d, ncl - 4, 4);
+        for(i = 0; i < ncl; ++i) deflate_bits(d, cllen[deflate_cl_order[i]], 3);
+        for(i = 0; i < nrle; ++i){
+            int s = rle[i] & 255, extra = rle[i] >> 8;
+            deflate_bits(d, clcode[s], cllen[s]);
+            if(s == 16) deflate_bits(d, extra, 2);
+            if(s == 17) deflate_bits(d, extra, 3);
+            if(s == 18) deflate_bits(d, extra, 7);
+        }
+        deflate_symbols(d, lcode, llen, dcode, dlen);
+    }
+    d->nsyms = 0;
+    d->block_start = d->pos;
+    memset(d->lit_freq, 0, sizeof(d->lit_freq));
+    memset(d->dist_freq, 0, sizeof(d->dist_freq));
+}
+
+// Find matches in buffered input. Unless this is the end of the stream,
+// stop DEFLATE_LOOKAHEAD bytes short so every match can reach its full
+// length.
+static void deflate_run(deflater *d, int final)
+{
+    int limit = final ? d->end : d->end - DEFLATE_LOOKAHEAD;
+    int cached = -1, cached_len = 0, cached_dist = 0;
+    while(d->pos < limit){
+        if(d->nsyms >= DEFLATE_BLOCK) deflate_block(d, 0);
+        int p = d->pos, dist = 0, len, i;
+        if(p == cached){
+            len = cached_len;
+            dist = cached_dist;
+        } else {
+            len = deflate_find(d, p, d->lv.chain, &dist);
+        }
+        deflate_insert(d, p);
+        if(len && len < d->lv.lazy && p + 1 < limit){
+            int dist2 = 0;
+            int chain = len >= d->lv.good ? d->lv.chain >> 2 : d->lv.chain;
+            int len2 = deflate_find(d, p + 1, chain, &dist2);
+            if(len2 > len){
+                deflate_literal(d, d->buf[p]);
+                d->pos = p + 1;
+                cached = p + 1;
+                cached_len = len2;
+                cached_dist = dist2;
+                continue;
+            }
+        }
+        if(len){
+            deflate_match(d, len, dist);
+            for(i = 1; i < len; ++i) deflate_insert(d, p + i);
+            d->pos += len;
+        } else {
+            deflate_literal(d, d->buf[p]);
+            ++d->pos;
+        }
+    }
+}
+
+// Drop input older than the window, rebasing the hash chains. Only
+// called between blocks.
+static void deflate_slide(deflater *d)
+{
+    int shift = d->pos - DEFLATE_WINDOW;
+    if(shift <= 0) return;
+    int n = d->end - shift;
+    int i;
+    memmove(d->buf, d->buf + shift, n);
+    memmove(d->prev, d->prev + shift, n*sizeof(int));
+    for(i = 0; i < (1 << DEFLATE_HASH_BITS); ++i) d->head[i] = d->head[i] >= shift ? d->head[i] - shift : -1;
+    for(i = 0; i < n; ++i) d->prev[i] = d->prev[i] >= shift ? d->prev[i] - shift : -1;
+    d->pos -= shift;
+    d->end -= shift;
+    d->block_start -= shift;
+}
+
+static void deflate_write(deflater *d, const unsigned char *data, int n)
+{
+    d->total_in += n;
+    while(n > 0){
+        if(d->end == DEFLATE_BUFFER){
+            deflate_run(d, 0);
+            if(d->nsyms) deflate_block(d, 0);
+            deflate_slide(d);
+        }
+        int m = MIN(n, DEFLATE_BUFFER - d->end);
+        unsigned int a = d->adler_a, b = d->adler_b;
+        int i, j;
+        for(i = 0; i < m; i += 5552){
+            int e = MIN(m, i + 5552);
+            for(j = i; j < e; ++j){
+                a += data[j];
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+        }
+        d->adler_a = a;
+        d->adler_b = b;
+        memcpy(d->buf + d->end, data, m);
+        d->end += m;
+        data += m;
+        n -= m;
+    }
+}
+
+static unsigned int deflate_adler(const deflater *d)
+{
+    return (d->adler_b << 16) | d->adler_a;
+}
+
+// Adler-32 of two pieces put together, from the checksum of each.
+// size_t len2: length of the second piece.
+static unsigned int adler32_combine(unsigned int a1, unsigned int a2, size_t len2)
+{
+    const unsigned int base = 65521;
+    unsigned int rem = len2 % base;
+    unsigned int s1 = a1 & 0xffff;
+    unsigned int s2 = (rem*s1) % base;
+    s1 += (a2 & 0xffff) + base - 1;
+    s2 += (a1 >> 16) + (a2 >> 16) + base - rem;
+    if(s1 >= base) s1 -= base;
+    if(s1 >= base) s1 -= base;
+    if(s2 >= 2*base) s2 -= 2*base;
+    if(s2 >= base) s2 -= base;
+    return s1 | s2 << 16;
+}
+
+static void deflate_u32(deflater *d, unsigned int v)
+{
+    int i;
+    for(i = 3; i >= 0; --i) deflate_bits(d, (v >> 8*i) & 255, 8);
+}
+
+// Compress what is left. The last piece of a stream ends with a final
+// block; any other piece ends on a byte boundary with an empty stored
+// block (a sync flush), so pieces compressed separately can be
+// concatenated.
+static void deflate_finish(deflater *d, int last)
+{
+    deflate_run(d, 1);
+    deflate_block(d, last);
+    if(!last) deflate_stored(d, 0, 0, 0);
+    deflate_align(d);
+}
+
+// Compressed bytes per IDAT chunk.
+#define PNG_IDAT 65536
+// Uncompressed bytes per piece when compressing on several threads.
+#define PNG_PIECE (256*1024)
+
+static int png_level = 6;
+static int png_filter = PNG_FILTER_ADAPTIVE;
+static int png_threads = 1;
+
+// Choose how PNGs are compressed, by save_rows, save_png and the savers.
+// int level: 0 stores without compression, 1 is fastest and good for
+//            intermediates, 9 is smallest. Default 6.
+// int filter: a fixed PNG_FILTER_* row filter, or PNG_FILTER_ADAPTIVE to
+//             pick the one with the smallest sum of absolute values for
+//             every row. Default adaptive.
+// int threads: threads compressing pieces of the image in parallel, each
+//              piece restarting the deflate window. Default 1.
+void set_png_options(int level, int filter, int threads)
+{
+    png_level = MIN(MAX(level, 0), 9);
+    png_filter = MIN(MAX(filter, PNG_FILTER_NONE), PNG_FILTER_ADAPTIVE);
+    png_threads = MAX(threads, 1);
+}
+
+static void make_crc_table(unsigned int *table)
+{
+    unsigned int i, k;
+    for(i = 0; i < 256; ++i){
+        unsigned int c = i;
+        for(k = 0; k < 8; ++k) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        table[i] = c;
+    }
+}
+
+static void put_u32(unsigned char *p, unsigned int v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static int png_chunk(FILE *fp, const unsigned int *crc_table, const char *type,
+        const unsigned char *data, size_t len)
+{
+    unsigned char hd[8];
+    put_u32(hd, len);
+    memcpy(hd + 4, type, 4);
+    unsigned int crc = 0xffffffffu;
+    size_t i;
+    for(i = 4; i < 8; ++i) crc = crc_table[(crc ^ hd[i]) & 255] ^ (crc >> 8);
+    if(fwrite(hd, 1, 8, fp) != 8) return 0;
+    // Empty chunks like IEND pass no data at all
+    if(len){
+        for(i = 0; i < len; ++i) crc = crc_table[(crc ^ data[i]) & 255] ^ (crc >> 8);
+        if(fwrite(data, 1, len, fp) != len) return 0;
+    }
+    unsigned char tail[4];
+    put_u32(tail, ~crc);
+    return fwrite(tail, 1, 4, fp) == 4;
+}
+
+static inline int paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if(pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+// Apply a PNG row filter.
+// unsigned char *out: n+1 bytes, the filter type then the filtered row.
+static void png_apply_filter(const unsigned char *cur, const unsigned char *prev, int n, int bpp,
+        int f, unsigned char *out)
+{
+    int i;
+    out[0] = f;
+    out++;
+    if(f == PNG_FILTER_NONE){
+        memcpy(out, cur, n);
+    } else if(f == PNG_FILTER_SUB){
+        for(i = 0; i < bpp; ++i) out[i] = cur[i];
+        for(i = bpp; i < n; ++i) out[i] = cur[i] - cur[i-bpp];
+    } else if(f == PNG_FILTER_UP){
+        for(i = 0; i < n; ++i) out[i] = cur[i] - prev[i];
+    } else if(f == PNG_FILTER_AVG){
+        for(i = 0; i < bpp; ++i) out[i] = cur[i] - (prev[i] >> 1);
+        for(i = bpp; i < n; ++i) out[i] = cur[i] - ((cur[i-bpp] + prev[i]) >> 1);
+    } else {
+        for(i = 0; i < bpp; ++i) out[i] = cur[i] - prev[i];
+        for(i = bpp; i < n; ++i) out[i] = cur[i] - paeth(cur[i-bpp], prev[i], prev[i-bpp]);
+    }
+}
+
+// Filter a row with the given filter, or with whichever filter gives the
+// smallest sum of absolute values for PNG_FILTER_ADAPTIVE.
+// unsigned char *filt: 5 rows of n+1 bytes of scratch.
+// returns: the filtered row, filter type first.
+static unsigned char *png_filter_row(const unsigned char *cur, const unsigned char *prev, int n, int bpp,
+        int filter, unsigned char *filt)
+{
+    if(filter != PNG_FILTER_ADAPTIVE){
+        png_apply_filter(cur, prev, n, bpp, filter, filt);
+        return filt;
+    }
+    int f, i;
+    int best = 0;
+    long best_sum = -1;
+    for(f = 0; f < 5; ++f){
+        unsigned char *out = filt + f*(n+1);
+        png_apply_filter(cur, prev, n, bpp, f, out);
+        long sum = 0;
+        for(i = 1; i <= n; ++i) sum += abs((signed char)out[i]);
+        if(best_sum < 0 || sum < best_sum){
+            best_sum = sum;
+            best = f;
+        }
+    }
+    return filt + best*(n+1);
+}
+
+// A run of rows compressed on its own, see save_rows_png_parallel.
+typedef struct{
+    const unsigned char *rows;
+    const unsigned char *prev;
+    int nrows, n, bpp;
+    int first, last;
+    deflater d;
+} png_piece;
+
+static void *png_piece_worker(void *arg)
+{
+    png_piece *p = arg;
+    unsigned char *filt = malloc(5*(p->n+1));
+    p->d = make_deflater(png_level, p->first);
+    int r;
+    for(r = 0; r < p->nrows; ++r){
+        const unsigned char *cur = p->rows + (size_t)r*p->n;
+        const unsigned char *prev = r ? cur - p->n : p->prev;
+        deflate_write(&p->d, png_filter_row(cur, prev, p->n, p->bpp, png_filter, filt), p->n+1);
+    }
+    deflate_finish(&p->d, p->last);
+    free(filt);
+    return 0;
+}
+
+// Compress pieces of PNG_PIECE bytes on png_threads threads at once, like
+// pigz. Each piece ends with a sync flush so the compressed pieces join
+// into one valid stream, and the Adler-32 of the whole is combined from
+// the pieces. Rows are still pulled in order, a round of pieces at a time.
+static int save_rows_png_parallel(row_source src, FILE *fp, const unsigned int *crc_table)
+{
+    int n = src.w*src.c;
+    int threads = png_threads;
+    int piece_rows = MAX(1, PNG_PIECE/(n+1));
+    int round_rows = piece_rows*threads;
+    float *tmp = malloc(n*sizeof(float));
+    // Row 0 is the last row of the previous round, zeros at the top
+    unsigned char *raw = calloc((size_t)(round_rows + 1)*n, 1);
+    png_piece *pieces = calloc(threads, sizeof(png_piece));
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    int *started = calloc(threads, sizeof(int));
+    unsigned int adler = 1;
+    int ok = 1;
+    int y0, j;
+    for(y0 = 0; ok && y0 < src.h; y0 += round_rows){
+        int rows = MIN(round_rows, src.h - y0);
+        int r;
+        for(r = 0; r < rows; ++r) row_u8(src, y0 + r, tmp, raw + (size_t)(r + 1)*n);
+        int np = (rows + piece_rows - 1)/piece_rows;
+        for(j = 0; j < np; ++j){
+            png_piece *p = pieces + j;
+            p->rows = raw + (size_t)(1 + j*piece_rows)*n;
+            p->prev = p->rows - n;
+            p->nrows = MIN(piece_rows, rows - j*piece_rows);
+            p->n = n;
+            p->bpp = src.c;
+            p->first = y0 == 0 && j == 0;
+            p->last = y0 + rows == src.h && j == np - 1;
+            started[j] = j > 0 && !pthread_create(tids + j, 0, png_piece_worker, p);
+        }
+        png_piece_worker(pieces);
+        for(j = 1; j < np; ++j){
+            if(started[j]) pthread_join(tids[j], 0);
+            else png_piece_worker(pieces + j);
+        }
+        for(j = 0; j < np; ++j){
+            deflater *d = &pieces[j].d;
+            adler = adler32_combine(adler, deflate_adler(d), d->total_in);
+            if(pieces[j].last) deflate_u32(d, adler);
+            ok = ok && png_chunk(fp, crc_table, "IDAT", d->out, d->out_len);
+            free_deflater(d);
+        }
+        memcpy(raw, raw + (size_t)rows*n, n);
+    }
+    free(tmp);
+    free(raw);
+    free(pieces);
+    free(tids);
+    free(started);
+    return ok;
+}
+
+static int save_rows_png(row_source src, FILE *fp)
+{
+    static const int color_type[5] = {0, 0, 4, 2, 6};
+    unsigned int crc_table[256];
+    make_crc_table(crc_table);
+    int n = src.w*src.c;
+    unsigned char sig[8] = {137, 'P', 'N', 'G', 13, 10, 26, 10};
+    unsigned char ihdr[13] = {0};
+    put_u32(ihdr, src.w);
+    put_u32(ihdr + 4, src.h);
+    ihdr[8] = 8;
+    ihdr[9] = color_type[src.c];
+    int ok = fwrite(sig, 1, 8, fp) == 8 && png_chunk(fp, crc_table, "IHDR", ihdr, 13);
+    if(ok && png_threads > 1 && (size_t)n*src.h > PNG_PIECE){
+        ok = save_rows_png_parallel(src, fp, crc_table);
+        return ok && png_chunk(fp, crc_table, "IEND", 0, 0);
+    }
+
+    float *tmp = malloc(n*sizeof(float));
+    unsigned char *prev = calloc(n, 1);
+    unsigned char *cur = malloc(n);
+    unsigned char *filt = malloc(5*(n+1));
+    deflater d = make_deflater(png_level, 1);
+    int y;
+    for(y = 0; ok && y < src.h; ++y){
+        row_u8(src, y, tmp, cur);
+        deflate_write(&d, png_filter_row(cur, prev, n, src.c, png_filter, filt), n+1);
+        unsigned char *t = prev;
+        prev = cur;
+        cur = t;
+        if(d.out_len >= PNG_IDAT){
+            ok = png_chunk(fp, crc_table, "IDAT", d.out, d.out_len);
+            d.out_len = 0;
+        }
+    }
+    deflate_finish(&d, 1);
+    deflate_u32(&d, deflate_adler(&d));
+    ok = ok && png_chunk(fp, crc_table, "IDAT", d.out, d.out_len);
+    ok = ok && png_chunk(fp, crc_table, "IEND", 0, 0);
+    free_deflater(&d);
+    free(tmp);
+    free(prev);
+    free(cur);
+    free(filt);
+    return ok;
+}
+
+// Baseline JPEG, 4:4:4 with the standard tables scaled by quality like
+// libjpeg and stb. Rows are pulled 8 at a time, one strip of blocks.
+static const unsigned char jpeg_zigzag[64] = {0,1,5,6,14,15,27,28,2,4,7,13,16,26,29,42,3,8,12,17,25,30,41,43,
+    9,11,18,24,31,40,44,53,10,19,23,32,39,45,52,54,20,22,33,38,46,51,55,60,21,34,37,47,50,56,59,61,
+    35,36,48,49,57,58,62,63};
+static const unsigned char jpeg_y_quant[64] = {16,11,10,16,24,40,51,61,12,12,14,19,26,58,60,55,
+    14,13,16,24,40,57,69,56,14,17,22,29,51,87,80,62,18,22,37,56,68,109,103,77,24,35,55,64,81,104,113,92,
+    49,64,78,87,103,121,120,101,72,92,95,98,112,100,103,99};
+static const unsigned char jpeg_uv_quant[64] = {17,18,24,47,99,99,99,99,18,21,26,66,99,99,99,99,
+    24,26,56,99,99,99,99,99,47,66,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,
+    99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99};
+static const unsigned char jpeg_dc_y_bits[16] = {0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
+static const unsigned char jpeg_dc_uv_bits[16] = {0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0};
+static const unsigned char jpeg_dc_values[12] = {0,1,2,3,4,5,6,7,8,9,10,11};
+static const unsigned char jpeg_ac_y_bits[16] = {0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d};
+static const unsigned char jpeg_ac_y_values[162] = {
+    0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,
+    0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
+    0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,
+    0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+    0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,
+    0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
+    0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa};
+static const unsigned char jpeg_ac_uv_bits[16] = {0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77};
+static const unsigned char jpeg_ac_uv_values[162] = {
+    0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,
+    0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
+    0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,
+    0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
+    0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,
+    0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
+    0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa};
+// AAN scale factors, the float DCT leaves coefficient (u, v) scaled by
+// 8*aan_scale[u]*aan_scale[v].
+static const float aan_scale[8] = {1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+    1.0f, 0.785694958f, 0.541196100f, 0.275899379f};
+
+typedef struct{
+    unsigned short code[256];
+    unsigned char size[256];
+} huffman_table;
+
+typedef struct{
+    FILE *fp;
+    unsigned int bits;
+    int nbits;
+} jpeg_writer;
+
+// Canonical codes from a list of code counts per length.
+static huffman_table make_huffman_table(const unsigned char *bits, const unsigned char *values)
+{
+    huffman_table t;
+    memset(&t, 0, sizeof(t));
+    int len, i, k = 0;
+    unsigned int code = 0;
+    for(len = 1; len <= 16; ++len){
+        for(i = 0; i < bits[len-1]; ++i, ++k){
+            t.code[values[k]] = code++;
+            t.size[values[k]] = len;
+        }
+        code <<= 1;
+    }
+    return t;
+}
+
+// Append bits to the entropy coded data, stuffing a 0 after every 0xff.
+static void jpeg_bits(jpeg_writer *j, unsigned int v, int n)
+{
+    j->bits = (j->bits << n) | (v & ((1u << n) - 1));
+    j->nbits += n;
+    while(j->nbits >= 8){
+        int b = (j->bits >> (j->nbits - 8)) & 255;
+        putc(b, j->fp);
+        if(b == 255) putc(0, j->fp);
+        j->nbits -= 8;
+    }
+    j->bits &= (1u << j->nbits) - 1;
+}
+
+// Magnitude category of a coefficient and the bits that follow it.
+static inline int jpeg_category(int v, unsigned int *extra)
+{
+    int a = v < 0 ? -v : v;
+    int n = 0;
+    while(a >> n) ++n;
+    *extra = v < 0 ? v - 1 : v;
+    return n;
+}
+
+// One pass of the AAN float DCT over 8 values spaced by stride.
+static void fdct8(float *d, int stride)
+{
+    float t0 = d[0] + d[7*stride], t7 = d[0] - d[7*stride];
+    float t1 = d[stride] + d[6*stride], t6 = d[stride] - d[6*stride];
+    float t2 = d[2*stride] + d[5*stride], t5 = d[2*stride] - d[5*stride];
+    float t3 = d[3*stride] + d[4*stride], t4 = d[3*stride] - d[4*stride];
+
+    float t10 = t0 + t3, t13 = t0 - t3;
+    float t11 = t1 + t2, t12 = t1 - t2;
+    d[0] = t10 + t11;
+    d[4*stride] = t10 - t11;
+    float z1 = (t12 + t13)*0.707106781f;
+    d[2*stride] = t13 + z1;
+    d[6*stride] = t13 - z1;
+
+    t10 = t4 + t5;
+    t11 = t5 + t6;
+    t12 = t6 + t7;
+    float z5 = (t10 - t12)*0.382683433f;
+    float z2 = 0.541196100f*t10 + z5;
+    float z4 = 1.306562965f*t12 + z5;
+    float z3 = t11*0.707106781f;
+    float z11 = t7 + z3, z13 = t7 - z3;
+    d[5*stride] = z13 + z2;
+    d[3*stride] = z13 - z2;
+    d[stride] = z11 + z4;
+    d[7*stride] = z11 - z4;
+}
+
+// Transform, quantize and entropy code one 8x8 block.
+// returns: the quantized DC value, to predict the next block's.
+static int jpeg_block(jpeg_writer *j, float *block, const float *divisor, int dc_prev,
+        const huffman_table *dc, const huffman_table *ac)
+{
+    int i;
+    for(i = 0; i < 8; ++i) fdct8(block + 8*i, 1);
+    for(i = 0; i < 8; ++i) fdct8(block + i, 8);
+    int q[64];
+    for(i = 0; i < 64; ++i){
+        float v = block[i]*divisor[i];
+        q[jpeg_zigzag[i]] = v < 0 ? (int)ceilf(v - .5f) : (int)floorf(v + .5f);
+    }
+    unsigned int extra;
+    int n = jpeg_category(q[0] - dc_prev, &extra);
+    jpeg_bits(j, dc->code[n], dc->size[n]);
+    if(n) jpeg_bits(j, extra, n);
+    int last = 63;
+    while(last > 0 && q[last] == 0) --last;
+    int run = 0;
+    for(i = 1; i <= last; ++i){
+        if(q[i] == 0){
+            ++run;
+            continue;
+        }
+        while(run >= 16){
+            jpeg_bits(j, ac->code[0xf0], ac->size[0xf0]);
+            run -= 16;
+        }
+        n = jpeg_category(q[i], &extra);
+        int s = (run << 4) | n;
+        jpeg_bits(j, ac->code[s], ac->size[s]);
+        jpeg_bits(j, extra, n);
+        run = 0;
+    }
+    if(last < 63) jpeg_bits(j, ac->code[0], ac->size[0]);
+    return q[0];
+}
+
+static void put_u16(unsigned char *p, int v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static int save_rows_jpg(row_source src, FILE *fp, int quality)
+{
+    // Gray or gray + alpha is written as 1 component, alpha is dropped.
+    int nc = src.c >= 3 ? 3 : 1;
+    int w = src.w, h = src.h;
+    quality = MIN(MAX(quality, 1), 100);
+    quality = quality < 50 ? 5000/quality : 200 - 2*quality;
+    unsigned char qt[2][64];
+    float divisor[2][64];
+    int i, k, x, y;
+    for(i = 0; i < 64; ++i){
+        qt[0][jpeg_zigzag[i]] = MIN(MAX((jpeg_y_quant[i]*quality + 50)/100, 1), 255);
+        qt[1][jpeg_zigzag[i]] = MIN(MAX((jpeg_uv_quant[i]*quality + 50)/100, 1), 255);
+    }
+    for(k = 0; k < 2; ++k){
+        for(i = 0; i < 64; ++i){
+            divisor[k][i] = 1/(qt[k][jpeg_zigzag[i]]*aan_scale[i/8]*aan_scale[i%8]*8);
+        }
+    }
+    huffman_table dc[2], ac[2];
+    dc[0] = make_huffman_table(jpeg_dc_y_bits, jpeg_dc_values);
+    ac[0] = make_huffman_table(jpeg_ac_y_bits, jpeg_ac_y_values);
+    dc[1] = make_huffman_table(jpeg_dc_uv_bits, jpeg_dc_values);
+    ac[1] = make_huffman_table(jpeg_ac_uv_bits, jpeg_ac_uv_values);
+
+    static const unsigned char jfif[20] = {0xff,0xd8,0xff,0xe0,0,16,'J','F','I','F',0,1,1,0,0,1,0,1,0,0};
+    fwrite(jfif, 1, sizeof(jfif), fp);
+    unsigned char hd[32];
+    put_u16(hd, 0xffdb);
+    put_u16(hd + 2, 2 + 65*(nc == 3 ? 2 : 1));
+    fwrite(hd, 1, 4, fp);
+    for(k = 0; k < (nc == 3 ? 2 : 1); ++k){
+        putc(k, fp);
+        fwrite(qt[k], 1, 64, fp);
+    }
+    put_u16(hd, 0xffc0);
+    put_u16(hd + 2, 8 + 3*nc);
+    hd[4] = 8;
+    put_u16(hd + 5, h);
+    put_u16(hd + 7, w);
+    hd[9] = nc;
+    for(k = 0; k < nc; ++k){
+        hd[10 + 3*k] = k + 1;
+        hd[11 + 3*k] = 0x11;
+        hd[12 + 3*k] = k > 0;
+    }
+    fwrite(hd, 1, 10 + 3*nc, fp);
+    const unsigned char *bits[4] = {jpeg_dc_y_bits, jpeg_ac_y_bits, jpeg_dc_uv_bits, jpeg_ac_uv_bits};
+    const unsigned char *values[4] = {jpeg_dc_values, jpeg_ac_y_values, jpeg_dc_values, jpeg_ac_uv_values};
+    const unsigned char ids[4] = {0x00, 0x10, 0x01, 0x11};
+    int ntables = nc == 3 ? 4 : 2;
+    int len = 2;
+    for(k = 0; k < ntables; ++k) len += 17 + (k & 1 ? 162 : 12);
+    put_u16(hd, 0xffc4);
+    put_u16(hd + 2, len);
+    fwrite(hd, 1, 4, fp);
+    for(k = 0; k < ntables; ++k){
+        putc(ids[k], fp);
+        fwrite(bits[k], 1, 16, fp);
+        fwrite(values[k], 1, k & 1 ? 162 : 12, fp);
+    }
+    put_u16(hd, 0xffda);
+    put_u16(hd + 2, 6 + 2*nc);
+    hd[4] = nc;
+    for(k = 0; k < nc; ++k){
+        hd[5 + 2*k] = k + 1;
+        hd[6 + 2*k] = k ? 0x11 : 0x00;
+    }
+    hd[5 + 2*nc] = 0;
+    hd[6 + 2*nc] = 63;
+    hd[7 + 2*nc] = 0;
+    fwrite(hd, 1, 8 + 2*nc, fp);
+
+    // Strip of 8 rows in 0-255, one plane per input channel
+    float *strip = malloc((size_t)8*w*src.c*sizeof(float));
+    jpeg_writer j = {fp, 0, 0};
+    int dc_prev[3] = {0};
+    int ys;
+    for(ys = 0; ys < h; ys += 8){
+        for(y = 0; y < 8; ++y){
+            int sy = MIN(ys + y, h-1);
+            for(k = 0; k < src.c; ++k){
+                float *row = strip + ((size_t)k*8 + y)*w;
+                src.get_row(src.data, sy, k, row);
+                for(x = 0; x < w; ++x) row[x] = MIN(MAX(row[x], 0.f), 1.f)*255;
+            }
+        }
+        int xs;
+        for(xs = 0; xs < w; xs += 8){
+            float block[3][64];
+            for(y = 0; y < 8; ++y){
+                for(x = 0; x < 8; ++x){
+                    int sx = MIN(xs + x, w-1);
+                    float r = strip[(size_t)y*w + sx];
+                    if(nc == 1){
+                        block[0][8*y + x] = r - 128;
+                        continue;
+                    }
+                    float g = strip[((size_t)8 + y)*w + sx];
+                    float b = strip[((size_t)16 + y)*w + sx];
+                    block[0][8*y + x] = .299f*r + .587f*g + .114f*b - 128;
+                    block[1][8*y + x] = -.16874f*r - .33126f*g + .5f*b;
+                    block[2][8*y + x] = .5f*r - .41869f*g - .08131f*b;
+                }
+            }
+            for(k = 0; k < nc; ++k){
+                int t = k > 0;
+                dc_prev[k] = jpeg_block(&j, block[k], divisor[t], dc_prev[k], dc + t, ac + t);
+            }
+        }
+    }
+    free(strip);
+    // Pad the last byte with 1 bits
+    if(j.nbits) jpeg_bits(&j, 0x7f, 8 - j.nbits);
+    putc(0xff, fp);
+    putc(0xd9, fp);
+    return !ferror(fp);
+}
+
+// Encode rows from a source straight to a file. Only a few rows are in
+// memory at once: one for PNG, a strip of 8 for JPEG.
+// row_source src: where to get the pixels, values are clamped to [0, 1].
+// const char *filename: file to write, extension included.
+// int png: 1 for PNG, 0 for JPEG at quality 100 like save_image.
+// returns: 1 on success, 0 if the file could not be written.
+int save_rows_file(row_source src, const char *filename, int png)
+{
+    assert(src.c >= 1 && src.c <= 4);
+    FILE *fp = fopen(filename, "wb");
+    int ok = 0;
+    if(fp){
+        ok = png ? save_rows_png(src, fp) : save_rows_jpg(src, fp, 100);
+        ok = fclose(fp) == 0 && ok;
+    }
+    if(!ok) fprintf(stderr, "Failed to write image %s\n", filename);
+    return ok;
+}
+
+// Encode rows to "<name>.png" or "<name>.jpg", see save_rows_file.
+// const char *name: file name without extension.
+int save_rows(row_source src, const char *name, int png)
+{
+    char *buff = malloc(strlen(name) + 5);
+    sprintf(buff, "%s.%s", name, png ? "png" : "jpg");
+    int ok = save_rows_file(src, buff, png);
+    free(buff);
+    return ok;
+}
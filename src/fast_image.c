@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+
+// Offsets of the 16 pixel Bresenham circle of radius 3, clockwise from
+// straight up.
+static const int ring_x[16] = {0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3, -3, -3, -2, -1};
+static const int ring_y[16] = {-3, -3, -2, -1, 0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3};
+
+// Harris cornerness at a single pixel, for scoring sparse detections.
+// Same response as harris_response, evaluated only where asked.
+// float *gray: single channel image data.
+// int x, y: pixel to score.
+// float *g: normalized 1d Gaussian of size dim.
+static float harris_score_at(const float *gray, int w, int h, int x, int y, const float *g, int dim)
+{
+    float sxx = 0, syy = 0, sxy = 0;
+    int s, t;
+    for(t = 0; t < dim; ++t){
+        int j = MIN(MAX(y - dim/2 + t, 0), h-1);
+        const float *r0 = gray + MAX(j-1, 0)*w;
+        const float *r1 = gray + j*w;
+        const float *r2 = gray + MIN(j+1, h-1)*w;
+        for(s = 0; s < dim; ++s){
+            int i = MIN(MAX(x - dim/2 + s, 0), w-1);
+            int il = MAX(i-1, 0), ir = MIN(i+1, w-1);
+            float ix = (r0[ir] - r0[il]) + 2*(r1[ir] - r1[il]) + (r2[ir] - r2[il]);
+            float iy = (r2[il] - r0[il]) + 2*(r2[i] - r0[i]) + (r2[ir] - r0[ir]);
+            float wt = g[t]*g[s];
+            sxx += wt*ix*ix;
+            syy += wt*iy*iy;
+            sxy += wt*ix*iy;
+        }
+    }
+    return sxx*syy - sxy*sxy - .06f*(sxx + syy)*(sxx + syy);
+}
+
+// Checks for a run of at least arc set bits in a circular 16 bit mask.
+static inline int has_arc(unsigned int m, int arc)
+{
+    m |= m << 16;
+    unsigned int run = m;
+    int k;
+    for(k = 1; k < arc; ++k) run &= m >> k;
+    return (run & 0xffff) != 0;
+}
+
+// FAST segment test corner detection.
+// A pixel is a corner if at least arc contiguous pixels of the radius 3
+// circle around it are all brighter than it by more than t, or all darker.
+// Every pixel of a row is tested at once: ring comparisons are packed
+// into 16 bit masks with straight-line code the compiler vectorizes, and
+// only pixels that pass the compass point pretest get the full arc check.
+// image im: input image, channels are averaged.
+// float t: intensity threshold, e.g. .1 for images in [0, 1].
+// int arc: 9 for FAST-9, 12 for FAST-12.
+// int nms: distance to look for higher scoring corners.
+// float sigma: if > 0, corners are scored by Harris cornerness with this
+//              sigma, computed only at FAST corners. Otherwise by how far
+//              the ring is past the threshold.
+// int *n: pointer to number of corners detected, filled in.
+// returns: array of descriptors of the corners in the image.
+descriptor *fast_corner_detector(image im, float t, int arc, int nms, float sigma, int *n)
+{
+    assert(arc >= 9 && arc <= 16);
+    int w = im.w, h = im.h;
+    int size = w*h;
+    int x, y, k;
+    // Scratch is given back to the arena in use before the descriptors are
+    // made, see harris_corner_detector.
+    arena_pos mark = arena_mark();
+    float *gray = arena_calloc(size, sizeof(float));
+    for(k = 0; k < im.c; ++k){
+        for(y = 0; y < h; ++y){
+            const float *s = &IMAGE_AT(im, 0, y, k);
+            for(x = 0; x < w; ++x) gray[y*w + x] += s[x];
+        }
+    }
+    for(x = 0; x < size; ++x) gray[x] *= 1.f/im.c;
+
+    int off[16];
+    for(k = 0; k < 16; ++k) off[k] = ring_y[k]*w + ring_x[k];
+    // How many of the 4 compass points any arc of this length must cover
+    int need = arc >= 12 ? 3 : 2;
+
+    int dim = sigma > 0 ? (int)ceilf(6*sigma) : 1;
+    dim = dim&1 ? dim : dim+1;
+    float g[dim];
+    float sum = 0;
+    for(k = 0; k < dim; ++k){
+        float x1 = dim/2 - k;
+        g[k] = sigma > 0 ? expf(-(x1*x1) / (2*sigma*sigma)) : 1;
+        sum += g[k];
+    }
+    for(k = 0; k < dim; ++k) g[k] /= sum;
+
+    image score = make_image(w, h, 1);
+    unsigned int *bright = arena_calloc(w, sizeof(unsigned int));
+    unsigned int *dark = arena_calloc(w, sizeof(unsigned int));
+    int count = 0;
+    for(y = 3; y < h-3; ++y){
+        const float *row = gray + y*w;
+        int x0 = 3, x1 = w-3;
+        for(x = x0; x < x1; ++x){
+            const float *p = row + x;
+            float hi = p[0] + t, lo = p[0] - t;
+            unsigned int b = 0, d = 0;
+            for(k = 0; k < 16; ++k){
+                b |= (unsigned int)(p[off[k]] > hi) << k;
+                d |= (unsigned int)(p[off[k]] < lo) << k;
+            }
+            bright[x] = b;
+            dark[x] = d;
+        }
+        for(x = x0; x < x1; ++x){
+            unsigned int b = bright[x], d = dark[x];
+            int nb = ((b >> 0) & 1) + ((b >> 4) & 1) + ((b >> 8) & 1) + ((b >> 12) & 1);
+            int nd = ((d >> 0) & 1) + ((d >> 4) & 1) + ((d >> 8) & 1) + ((d >> 12) & 1);
+            if(nb < need && nd < need) continue;
+            if(!has_arc(b, arc) && !has_arc(d, arc)) continue;
+            float s;
+            if(sigma > 0){
+                s = harris_score_at(gray, w, h, x, y, g, dim);
+            } else {
+                const float *p = row + x;
+                s = 0;
+                for(k = 0; k < 16; ++k) s += MAX(fabsf(p[off[k]] - p[0]) - t, 0);
+            }
+            // Keep every segment test corner even if Harris disagrees
+            score.data[y*w + x] = MAX(s, 1e-20f);
+            ++count;
+        }
+    }
+    arena_free(bright);
+    arena_free(dark);
+    arena_free(gray);
+
+    int *keep = calloc(count, sizeof(int));
+    int kept = 0;
+    for(y = 3; y < h-3; ++y){
+        for(x = 3; x < w-3; ++x){
+            float v = score.data[y*w + x];
+            if(v == 0) continue;
+            int i, j, beaten = 0;
+            for(j = MAX(y-nms, 0); j < MIN(y+nms+1, h) && !beaten; ++j){
+                for(i = MAX(x-nms, 0); i < MIN(x+nms+1, w); ++i){
+                    if(score.data[j*w + i] > v){
+                        beaten = 1;
+                        break;
+                    }
+                }
+            }
+            if(!beaten) keep[kept++] = y*w + x;
+        }
+    }
+    free_image(score);
+    arena_rewind(mark);
+
+    *n = kept;
+    descriptor *d = arena_calloc(kept, sizeof(descriptor));
+    int i;
+    for(i = 0; i < kept; ++i) d[i] = describe_index(im, keep[i]);
+    free(keep);
+    return d;
+}
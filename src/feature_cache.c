@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+
+// Cache files are a header, the fixed size part of every descriptor, then
+// all of the descriptor values back to back.
+#define FEATURE_CACHE_MAGIC "UWFC"
+#define FEATURE_CACHE_VERSION 1
+// Identifies what describe_index produces, bump it when that changes so
+// old entries stop matching.
+#define FEATURE_CACHE_DESCRIPTOR 1
+
+typedef struct{
+    char magic[4];
+    int version;
+    unsigned long long hash;
+    int w, h, c;
+    int detector;
+    float fast_thresh, sigma, thresh;
+    int nms;
+    int descriptor;
+    int count;
+} feature_cache_header;
+
+typedef struct{
+    float x, y, scale;
+    int n;
+} feature_cache_record;
+
+// 64-bit hash of a buffer. Words are mixed into four independent lanes so
+// the multiplies overlap, which keeps hashing well ahead of decoding.
+static unsigned long long hash_bytes(const void *data, size_t size)
+{
+    const unsigned long long k = 0x9e3779b97f4a7c15ull;
+    unsigned long long lane[4] = {k, k ^ 1, k ^ 2, k ^ 3};
+    const unsigned char *p = data;
+    size_t i, j;
+    for(i = 0; i + 32 <= size; i += 32){
+        for(j = 0; j < 4; ++j){
+            unsigned long long w;
+            memcpy(&w, p + i + 8*j, 8);
+            lane[j] = (lane[j] ^ w)*k;
+            lane[j] ^= lane[j] >> 32;
+        }
+    }
+    unsigned long long h = size;
+    for(j = 0; j < 4; ++j) h = (h ^ lane[j])*k;
+    for(; i < size; ++i) h = (h ^ p[i])*0x100000001b3ull;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+}
+
+// Make a cache of detected features in a directory, created if needed.
+// const char *dir: directory holding one file per image and settings.
+// returns: the cache, free with free_feature_cache.
+feature_cache make_feature_cache(const char *dir)
+{
+    feature_cache fc = {0};
+    fc.dir = malloc(strlen(dir) + 1);
+    strcpy(fc.dir, dir);
+    mkdir(dir, 0755);
+    return fc;
+}
+
+void free_feature_cache(feature_cache *fc)
+{
+    free(fc->dir);
+    fc->dir = 0;
+}
+
+// Remove every entry of a cache from disk.
+void clear_feature_cache(feature_cache *fc)
+{
+    DIR *d = opendir(fc->dir);
+    if(!d) return;
+    struct dirent *e;
+    char *path = malloc(strlen(fc->dir) + 258);
+    while((e = readdir(d))){
+        size_t len = strlen(e->d_name);
+        if(len < 5 || strcmp(e->d_name + len - 5, ".feat")) continue;
+        sprintf(path, "%s/%s", fc->dir, e->d_name);
+        remove(path);
+    }
+    free(path);
+    closedir(d);
+}
+
+// Read an entry, checking that every part of the key matches.
+// returns: descriptors, or 0 if there is no usable entry.
+static descriptor *feature_cache_read(const char *path, const feature_cache_header *key, int *n)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return 0;
+    struct stat st;
+    if(fstat(fd, &st) || (size_t)st.st_size < sizeof(feature_cache_header)){
+        close(fd);
+        return 0;
+    }
+    size_t size = st.st_size;
+    const unsigned char *map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return 0;
+
+    feature_cache_header hd;
+    memcpy(&hd, map, sizeof(hd));
+    int count = hd.count;
+    hd.count = key->count;
+    descriptor *d = 0;
+    size_t off = sizeof(hd) + (size_t)MAX(count, 0)*sizeof(feature_cache_record);
+    if(memcmp(&hd, key, sizeof(hd)) || count < 0 || off > size) goto done;
+    const feature_cache_record *rec = (const feature_cache_record *)(map + sizeof(hd));
+    const float *values = (const float *)(map + off);
+    size_t total = 0;
+    int i;
+    for(i = 0; i < count; ++i) total += rec[i].n;
+    if(off + total*sizeof(float) != size) goto done;
+
+    d = arena_calloc(MAX(count, 1), sizeof(descriptor));
+    for(i = 0; i < count; ++i){
+        d[i].p.x = rec[i].x;
+        d[i].p.y = rec[i].y;
+        d[i].scale = rec[i].scale;
+        d[i].n = rec[i].n;
+        d[i].data = arena_calloc(rec[i].n, sizeof(float));
+        memcpy(d[i].data, values, rec[i].n*sizeof(float));
+        values += rec[i].n;
+    }
+    *n = count;
+done:
+    munmap((void *)map, size);
+    return d;
+}
+
+// Write an entry to a temporary file and move it in place, so readers
+// never see a partial entry.
+static void feature_cache_write(const char *path, feature_cache_header hd, descriptor *d, int n)
+{
+    char *tmp = malloc(strlen(path) + 32);
+    sprintf(tmp, "%s.%d.tmp", path, (int)getpid());
+    FILE *fp = fopen(tmp, "wb");
+    if(!fp){
+        free(tmp);
+        return;
+    }
+    hd.count = n;
+    int ok = fwrite(&hd, sizeof(hd), 1, fp) == 1;
+    int i;
+    for(i = 0; ok && i < n; ++i){
+        feature_cache_record r = {d[i].p.x, d[i].p.y, d[i].scale, d[i].n};
+        ok = fwrite(&r, sizeof(r), 1, fp) == 1;
+    }
+    for(i = 0; ok && i < n; ++i){
+        ok = fwrite(d[i].data, sizeof(float), d[i].n, fp) == (size_t)d[i].n;
+    }
+    ok = fclose(fp) == 0 && ok;
+    if(!ok || rename(tmp, path)) remove(tmp);
+    free(tmp);
+}
+
+// Detect corners like run_corner_detector, going through a cache.
+// Entries are keyed by a hash of the pixels and every setting that changes
+// the result, so a hit is exactly what detection would have returned.
+// feature_cache *fc: the cache, hits and misses are counted in it.
+// returns: array of descriptors of the corners in the image.
+descriptor *feature_cache_detect(feature_cache *fc, image im, int detector, float fast_thresh,
+        float sigma, float thresh, int nms, int *n)
+{
+    feature_cache_header key;
+    memset(&key, 0, sizeof(key));
+    memcpy(key.magic, FEATURE_CACHE_MAGIC, 4);
+    key.version = FEATURE_CACHE_VERSION;
+    // Views hash like the packed image they show
+    image packed = IMAGE_PACKED(im) ? im : copy_image(im);
+    key.hash = hash_bytes(packed.data, (size_t)im.w*im.h*im.c*sizeof(float));
+    if(packed.data != im.data) free_image(packed);
+    key.w = im.w;
+    key.h = im.h;
+    key.c = im.c;
+    key.detector = detector;
+    key.fast_thresh = detector == DETECTOR_HARRIS ? 0 : fast_thresh;
+    key.sigma = sigma;
+    key.thresh = detector == DETECTOR_HARRIS ? thresh : 0;
+    key.nms = nms;
+    key.descriptor = FEATURE_CACHE_DESCRIPTOR;
+
+    unsigned long long name = hash_bytes(&key, sizeof(key));
+    char *path = malloc(strlen(fc->dir) + 32);
+    sprintf(path, "%s/%016llx.feat", fc->dir, name);
+    descriptor *d = feature_cache_read(path, &key, n);
+    if(d){
+        ++fc->hits;
+    } else {
+        ++fc->misses;
+        d = run_corner_detector(im, detector, fast_thresh, sigma, thresh, nms, n);
+        feature_cache_write(path, key, d, *n);
+    }
+    free(path);
+    return d;
+}
@@ -36,47 +36,98 @@ int _similar(color* a, color* b, float tolerance){
 }
 
 
+// Convolve an image with a filter, clamping to the edges.
+// The inner loops run over whole rows without any clamping and taps are
+// accumulated a row at a time, reading past the edges into a replicated
+// border. An image from pad_image whose border is at least half the
+// filter wide is read in place, anything else is first copied into a
+// padded image.
+// image im: image to filter. If padded, its border must be filled in, see
+//           replicate_border.
+// image filter: filter with 1 channel or as many channels as im.
+// int preserve: 1 to filter each channel on its own, 0 to sum the
+//               channels into a 1 channel result, divided by im.c.
+// returns: the filtered image.
 image convolve_image(image im, image filter, int preserve)
 {
     assert(filter.c == 1 || filter.c == im.c);
-    if(!preserve){
-        image res = make_image(im.w,im.h,1);
-        for(int y=0;y<res.h;++y){
-            for(int x=0;x<res.w;++x){
-                float res1 = 0;
-                for(int c=0;c<im.c;++c){
-                    for(int y1=0;y1<filter.h;++y1){
-                        for(int x1=0;x1<filter.w;++x1){
-                            res1 += get_pixel(filter,x1,y1,filter.c==1?0:c) *
-                                    get_pixel(im,x-filter.w/2+x1,y-filter.h/2+y1,c);
-                        }
+    int fw = filter.w, fh = filter.h;
+    int pad = MAX(fw, fh)/2;
+    image p = im.pad >= pad ? im : pad_image(im, pad);
+    image res = make_image(im.w, im.h, preserve ? im.c : 1);
+    int x, y, c, x1, y1;
+    for(int k=0;k<res.c;++k){
+        for(y=0;y<res.h;++y){
+            float *out = &IMAGE_AT(res, 0, y, k);
+            // Without preserve every channel adds into the same row
+            for(c = preserve ? k : 0; c < (preserve ? k+1 : im.c); ++c){
+                for(y1=0;y1<fh;++y1){
+                    const float *src = &IMAGE_AT(p, -fw/2, y-fh/2+y1, c);
+                    for(x1=0;x1<fw;++x1){
+                        float f = IMAGE_AT(filter, x1, y1, filter.c==1?0:c);
+                        for(x=0;x<res.w;++x) out[x] += f*src[x1+x];
                     }
                 }
-                set_pixel(res,x,y,0,res1 / (float)im.c);
             }
+            if(!preserve) for(x=0;x<res.w;++x) out[x] /= (float)im.c;
         }
-        return res;
     }
-    else{
-        image res = make_image(im.w,im.h,im.c);
-        for(int c=0;c<im.c;++c){
-            for(int y=0;y<res.h;++y){
-                for(int x=0;x<res.w;++x){
-                    float res1 = 0;
-                    for(int y1=0;y1<filter.h;++y1){
-                        for(int x1=0;x1<filter.w;++x1){
-                            res1 += get_pixel(filter,x1,y1,filter.c==1?0:c) *
-                                    get_pixel(im,x-filter.w/2+x1,y-filter.h/2+y1,c);
-                        }
-                        
-                    }
-                    set_pixel(res,x,y,c,res1);
+    if(p.data != im.data) free_image(p);
+    return res;
+}
+
+// Convolve a typed image, keeping its storage type. Same result as
+// convolve_image with edges clamped, but only filter.h rows per channel
+// are widened to float at a time, each padded with its replicated edge
+// pixels so the inner loop needs no clamping and vectorizes.
+// typed_image im: image to convolve.
+// image filter: 1 channel, or one per channel of im.
+// int preserve: 1 to keep the channels, 0 to average them into one.
+// returns: convolved image of the same dtype. Integer types clamp to [0, 1].
+typed_image convolve_typed(typed_image im, image filter, int preserve)
+{
+    assert(filter.c == 1 || filter.c == im.c);
+    int fw = filter.w, fh = filter.h;
+    int rx = fw/2, ry = fh/2;
+    int pw = im.w + fw - 1;
+    typed_image res = make_typed_image(im.w, im.h, preserve ? im.c : 1, im.dtype);
+    float *ring = malloc((size_t)im.c*fh*pw*sizeof(float));
+    int *rowid = malloc(im.c*fh*sizeof(int));
+    float *acc = malloc(im.w*sizeof(float));
+    int i, k, x, y, x1, y1;
+    for(i = 0; i < im.c*fh; ++i) rowid[i] = -1 - fh;
+    for(y = 0; y < im.h; ++y){
+        if(!preserve) memset(acc, 0, im.w*sizeof(float));
+        for(k = 0; k < im.c; ++k){
+            if(preserve) memset(acc, 0, im.w*sizeof(float));
+            int fk = filter.c == 1 ? 0 : k;
+            for(y1 = 0; y1 < fh; ++y1){
+                int sy = y - ry + y1;
+                int slot = k*fh + (sy + fh) % fh;
+                float *r = ring + (size_t)slot*pw;
+                if(rowid[slot] != sy){
+                    typed_get_row(im, MIN(MAX(sy, 0), im.h-1), k, r + rx);
+                    for(x = 0; x < rx; ++x) r[x] = r[rx];
+                    for(x = rx + im.w; x < pw; ++x) r[x] = r[rx + im.w - 1];
+                    rowid[slot] = sy;
+                }
+                for(x1 = 0; x1 < fw; ++x1){
+                    float wv = IMAGE_AT(filter, x1, y1, fk);
+                    const float *s = r + x1;
+                    for(x = 0; x < im.w; ++x) acc[x] += wv*s[x];
                 }
             }
+            if(preserve) typed_set_row(res, y, k, acc);
+        }
+        if(!preserve){
+            for(x = 0; x < im.w; ++x) acc[x] *= 1.f/im.c;
+            typed_set_row(res, y, 0, acc);
         }
-        return res;
     }
-    return make_image(1,1,1);
+    free(ring);
+    free(rowid);
+    free(acc);
+    return res;
 }
 
 image make_box_filter(int w)
@@ -261,8 +312,10 @@ void feature_normalize(image im)
 
 image *sobel_image(image im)
 {
-    image gximg = convolve_image(im, make_gx_filter(), 0);
-    image gyimg = convolve_image(im, make_gy_filter(), 0);
+    image gxf = make_gx_filter();
+    image gyf = make_gy_filter();
+    image gximg = convolve_image(im, gxf, 0);
+    image gyimg = convolve_image(im, gyf, 0);
     image* res = (image*)calloc(2, sizeof(image));
     image mag = make_image(im.w,im.h,1);
     image dir = make_image(im.w,im.h,1);
@@ -281,6 +334,10 @@ image *sobel_image(image im)
     }
     //feature_normalize(dir);
     //clamp_image(mag);
+    free_image(gximg);
+    free_image(gyimg);
+    free_image(gxf);
+    free_image(gyf);
     return res;
 
 }
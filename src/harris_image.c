@@ -15,9 +15,9 @@ void free_descriptors(descriptor *d, int n)
 {
     int i;
     for(i = 0; i < n; ++i){
-        free(d[i].data);
+        arena_free(d[i].data);
     }
-    free(d);
+    arena_free(d);
 }
 
 // Create a feature descriptor for an index in an image.
@@ -30,7 +30,8 @@ descriptor describe_index(image im, int i)
     descriptor d;
     d.p.x = i%im.w;
     d.p.y = i/im.w;
-    d.data = calloc(w*w*im.c, sizeof(float));
+    d.scale = 1;
+    d.data = arena_calloc(w*w*im.c, sizeof(float));
     d.n = w*w*im.c;
     int c, dx, dy;
     int count = 0;
@@ -38,7 +39,7 @@ descriptor describe_index(image im, int i)
     // This subtracts the central value from neighbors
     // to compensate some for exposure/lighting changes.
     for(c = 0; c < im.c; ++c){
-        float cval = im.data[c*im.w*im.h + i];
+        float cval = IMAGE_AT(im, i%im.w, i/im.w, c);
         for(dx = -w/2; dx < (w+1)/2; ++dx){
             for(dy = -w/2; dy < (w+1)/2; ++dy){
                 float val = get_pixel(im, i%im.w+dx, i/im.w+dy, c);
@@ -105,10 +106,12 @@ image make_1d_gaussian(float sigma)
 image smooth_image(image im, float sigma)
 {
     image f = make_1d_gaussian(sigma);
-    image res = convolve_image(im,f,1);
+    image tmp = convolve_image(im,f,1);
     f.h = f.w;
     f.w = 1;
-    res = convolve_image(res,f,1);
+    image res = convolve_image(tmp,f,1);
+    free_image(tmp);
+    free_image(f);
     return res;
 }
 
@@ -120,8 +123,10 @@ image smooth_image(image im, float sigma)
 image structure_matrix(image im, float sigma)
 {
     image S = make_image(im.w, im.h, 3);
-    image Ix = convolve_image(im, make_gx_filter(), 0);
-    image Iy = convolve_image(im, make_gy_filter(), 0);
+    image gx = make_gx_filter();
+    image gy = make_gy_filter();
+    image Ix = convolve_image(im, gx, 0);
+    image Iy = convolve_image(im, gy, 0);
     for(int y=0;y<S.h;++y){
         for(int x=0;x<S.w;++x){
             float ix = get_pixel(Ix,x,y,0);
@@ -141,8 +146,13 @@ image structure_matrix(image im, float sigma)
             set_pixel(S,x,y,2,ix*iy);
         }
     }
-    S = smooth_image(S,sigma);
-    return S;
+    image smoothed = smooth_image(S,sigma);
+    free_image(S);
+    free_image(Ix);
+    free_image(Iy);
+    free_image(gx);
+    free_image(gy);
+    return smoothed;
 }
 
 // Estimate the cornerness of each pixel given a structure matrix S.
@@ -165,6 +175,98 @@ image cornerness_response(image S)
     return R;
 }
 
+// Harris cornerness straight from an image, same as
+// cornerness_response(structure_matrix(im, sigma)) but fused: gradients
+// and their products are made in one pass, and the vertical half of the
+// Gaussian computes the response as it goes, so the smoothed structure
+// matrix is never stored.
+// image im: the input image.
+// float sigma: std dev. to use for weighted sum.
+// returns: a response map of cornerness calculations.
+image harris_response(image im, float sigma)
+{
+    int w = im.w, h = im.h;
+    int size = w*h;
+    int x, y, k, t;
+
+    int dim = (int)ceilf(6*sigma);
+    dim = dim&1 ? dim : dim+1;
+    float g[dim];
+    float sum = 0;
+    for(t = 0; t < dim; ++t){
+        float x1 = dim/2 - t;
+        g[t] = expf(-(x1*x1) / (2*sigma*sigma));
+        sum += g[t];
+    }
+    for(t = 0; t < dim; ++t) g[t] /= sum;
+
+    // Mean over channels, the gradient filters don't preserve channels
+    float *gray = arena_calloc(size, sizeof(float));
+    for(k = 0; k < im.c; ++k){
+        for(y = 0; y < h; ++y){
+            const float *s = &IMAGE_AT(im, 0, y, k);
+            for(x = 0; x < w; ++x) gray[y*w + x] += s[x];
+        }
+    }
+    for(x = 0; x < size; ++x) gray[x] *= 1.f/im.c;
+
+    // Sobel gradients and their products
+    float *S = arena_calloc(3*size, sizeof(float));
+    for(y = 0; y < h; ++y){
+        const float *r0 = gray + MAX(y-1, 0)*w;
+        const float *r1 = gray + y*w;
+        const float *r2 = gray + MIN(y+1, h-1)*w;
+        for(x = 0; x < w; ++x){
+            int xl = MAX(x-1, 0), xr = MIN(x+1, w-1);
+            float ix = (r0[xr] - r0[xl]) + 2*(r1[xr] - r1[xl]) + (r2[xr] - r2[xl]);
+            float iy = (r2[xl] - r0[xl]) + 2*(r2[x] - r0[x]) + (r2[xr] - r0[xr]);
+            S[y*w + x] = ix*ix;
+            S[size + y*w + x] = iy*iy;
+            S[2*size + y*w + x] = ix*iy;
+        }
+    }
+    arena_free(gray);
+
+    // Horizontal Gaussian
+    float *T = arena_calloc(3*size, sizeof(float));
+    for(k = 0; k < 3; ++k){
+        for(y = 0; y < h; ++y){
+            const float *s = S + k*size + y*w;
+            float *d = T + k*size + y*w;
+            for(x = 0; x < w; ++x){
+                float v = 0;
+                for(t = 0; t < dim; ++t) v += g[t]*s[MIN(MAX(x - dim/2 + t, 0), w-1)];
+                d[x] = v;
+            }
+        }
+    }
+    arena_free(S);
+
+    // Vertical Gaussian and response
+    image R = make_image(w, h, 1);
+    float alpha = .06f;
+    float *row = arena_calloc(3*w, sizeof(float));
+    for(y = 0; y < h; ++y){
+        memset(row, 0, 3*w*sizeof(float));
+        for(t = 0; t < dim; ++t){
+            int sy = MIN(MAX(y - dim/2 + t, 0), h-1);
+            for(k = 0; k < 3; ++k){
+                const float *s = T + k*size + sy*w;
+                float *d = row + k*w;
+                for(x = 0; x < w; ++x) d[x] += g[t]*s[x];
+            }
+        }
+        for(x = 0; x < w; ++x){
+            float a00 = row[x], a11 = row[w + x], a10 = row[2*w + x];
+            float tr = a00 + a11;
+            R.data[y*w + x] = a00*a11 - a10*a10 - alpha*tr*tr;
+        }
+    }
+    arena_free(row);
+    arena_free(T);
+    return R;
+}
+
 // Perform non-max supression on an image of feature responses.
 // image im: 1-channel image of feature responses.
 // int w: distance to look for larger responses.
@@ -193,7 +295,49 @@ image nms_image(image im, int w)
     //     for neighbors within w:
     //         if neighbor response greater than pixel response:
     //             set response to be very low (I use -999999 [why not 0??])
-    return im;
+    return r;
+}
+
+// Refine a corner to subpixel accuracy. Fits a quadratic
+// f = a + bx + cy + dx^2 + exy + fy^2 to the 3x3 responses around the
+// corner by least squares and moves to its peak. Falls back to the pixel
+// itself when the fit has no maximum or the peak is more than a pixel away.
+// image R: response map.
+// int x, y: corner pixel, a local maximum of R.
+// returns: refined position of the corner.
+point refine_corner(image R, int x, int y)
+{
+    point p = make_point(x, y);
+    if(x < 1 || y < 1 || x >= R.w-1 || y >= R.h-1) return p;
+    float v[3][3];
+    int i, j;
+    for(j = 0; j < 3; ++j){
+        for(i = 0; i < 3; ++i) v[j][i] = R.data[(y+j-1)*R.w + x+i-1];
+    }
+    // Closed form of the least squares fit on the 3x3 grid
+    float sum = 0, sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+    for(j = 0; j < 3; ++j){
+        for(i = 0; i < 3; ++i){
+            float f = v[j][i];
+            sum += f;
+            sx += (i-1)*f;
+            sy += (j-1)*f;
+            sxx += (i-1)*(i-1)*f;
+            syy += (j-1)*(j-1)*f;
+            sxy += (i-1)*(j-1)*f;
+        }
+    }
+    float b = sx/6, c = sy/6, e = sxy/4;
+    float d = sxx/2 - sum/3, f = syy/2 - sum/3;
+    // Peak where the gradient vanishes: [2d e; e 2f] * o = -[b c]
+    float det = 4*d*f - e*e;
+    if(d >= 0 || det <= 0) return p;
+    float ox = (-2*f*b + e*c)/det;
+    float oy = (e*b - 2*d*c)/det;
+    if(fabsf(ox) > 1 || fabsf(oy) > 1) return p;
+    p.x += ox;
+    p.y += oy;
+    return p;
 }
 
 // Perform harris corner detection and extract features from the corners.
@@ -205,6 +349,10 @@ image nms_image(image im, int w)
 // returns: array of descriptors of the corners in the image.
 descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n)
 {
+    // The maps below are given back to the arena in use before the
+    // descriptors are made, so only the corners outlive them.
+    arena_pos mark = arena_mark();
+
     // Calculate structure matrix
     image S = structure_matrix(im, sigma);
 
@@ -223,16 +371,15 @@ descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms,
         }
     }
 
-    
-    *n = count; // <- set *n equal to number of corners in image.
-    descriptor *d = calloc(count, sizeof(descriptor));
+    int *index = calloc(count, sizeof(int));
+    point *p = calloc(count, sizeof(point));
     int i = 0;
     for (int y=0;y<Rnms.h;++y){
         for (int x=0;x<Rnms.w;++x){
             float v = get_pixel(Rnms,x,y,0);
             if(v>thresh){
-                int index = y*Rnms.w + x;
-                d[i++] = describe_index(im,index);
+                index[i] = y*Rnms.w + x;
+                p[i++] = refine_corner(R, x, y);
             }
         }
     }
@@ -240,9 +387,175 @@ descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms,
     free_image(S);
     free_image(R);
     free_image(Rnms);
+    arena_rewind(mark);
+
+    *n = count; // <- set *n equal to number of corners in image.
+    descriptor *d = arena_calloc(count, sizeof(descriptor));
+    for(i = 0; i < count; ++i){
+        d[i] = describe_index(im, index[i]);
+        d[i].p = p[i];
+    }
+    free(index);
+    free(p);
     return d;
 }
 
+// Checks whether any response in a window is larger than v.
+// image R: response map.
+// int x, y: center of the window.
+// int w: half size of the window.
+// returns: 1 if something in the window beats v.
+static int beaten_in_window(image R, int x, int y, int w, float v)
+{
+    int i, j;
+    for(j = MAX(y-w, 0); j < MIN(y+w+1, R.h); ++j){
+        for(i = MAX(x-w, 0); i < MIN(x+w+1, R.w); ++i){
+            if(R.data[j*R.w + i] > v) return 1;
+        }
+    }
+    return 0;
+}
+
+// Harris corners over every level of a pyramid (Harris-Laplace style).
+// A corner has to be above thresh and the largest response within nms
+// pixels at its own level and at the corresponding spots of the levels
+// right above and below it. Responses of the levels are computed in
+// parallel under OPENMP=1.
+// image_pyramid *p: pyramid of the image, levels are built if needed.
+// float sigma: std. dev for harris, in pixels of each level.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// int *n: pointer to number of corners detected, should fill in.
+// returns: array of descriptors, p in full resolution coordinates and
+//          scale set to the level's shrink factor.
+descriptor *harris_pyramid_detector(image_pyramid *p, float sigma, float thresh, int nms, int *n)
+{
+    int L = p->levels;
+    int l, x, y;
+    pyramid_level(p, L-1);
+    // Responses are given back to the arena in use before the descriptors
+    // are made, see harris_corner_detector.
+    arena_pos mark = arena_mark();
+    image R[PYRAMID_MAX_LEVELS];
+    #pragma omp parallel for
+    for(l = 0; l < L; ++l){
+        R[l] = harris_response(p->level[l], sigma);
+    }
+
+    int count = 0;
+    int cap = 64;
+    int *found = calloc(2*cap, sizeof(int));
+    for(l = 0; l < L; ++l){
+        for(y = 0; y < R[l].h; ++y){
+            for(x = 0; x < R[l].w; ++x){
+                float v = R[l].data[y*R[l].w + x];
+                if(v <= thresh) continue;
+                if(beaten_in_window(R[l], x, y, nms, v)) continue;
+                if(l > 0 && beaten_in_window(R[l-1], 2*x, 2*y, 2*nms, v)) continue;
+                if(l+1 < L && beaten_in_window(R[l+1], x/2, y/2, (nms+1)/2, v)) continue;
+                if(count == cap){
+                    cap *= 2;
+                    found = realloc(found, 2*cap*sizeof(int));
+                }
+                found[2*count] = l;
+                found[2*count+1] = y*R[l].w + x;
+                ++count;
+            }
+        }
+    }
+
+    point *pos = calloc(count, sizeof(point));
+    int i;
+    for(i = 0; i < count; ++i){
+        l = found[2*i];
+        int index = found[2*i+1];
+        pos[i] = refine_corner(R[l], index%R[l].w, index/R[l].w);
+    }
+    for(l = 0; l < L; ++l) free_image(R[l]);
+    arena_rewind(mark);
+
+    *n = count;
+    descriptor *d = arena_calloc(count, sizeof(descriptor));
+    for(i = 0; i < count; ++i){
+        l = found[2*i];
+        d[i] = describe_index(p->level[l], found[2*i+1]);
+        d[i].scale = 1 << l;
+        d[i].p.x = pos[i].x*d[i].scale;
+        d[i].p.y = pos[i].y*d[i].scale;
+    }
+    free(found);
+    free(pos);
+    return d;
+}
+
+// Multi-scale Harris corner detection, see harris_pyramid_detector.
+// int levels: number of pyramid levels to search, 1 is single scale.
+descriptor *harris_corner_detector_multiscale(image im, float sigma, float thresh, int nms, int levels, int *n)
+{
+    image_pyramid p = make_image_pyramid(im, levels);
+    descriptor *d = harris_pyramid_detector(&p, sigma, thresh, nms, n);
+    free_image_pyramid(p);
+    return d;
+}
+
+// Detector used by detect_corners, see set_corner_detector.
+static int corner_detector = DETECTOR_HARRIS;
+static float corner_fast_thresh = .1f;
+
+// Choose the corner detector used by detect_and_draw_corners,
+// find_and_draw_matches and panorama_image.
+// int detector: DETECTOR_HARRIS, DETECTOR_FAST9 or DETECTOR_FAST12.
+// float fast_thresh: intensity threshold of the FAST segment test.
+void set_corner_detector(int detector, float fast_thresh)
+{
+    corner_detector = detector;
+    corner_fast_thresh = fast_thresh;
+}
+
+// Cache consulted by detect_corners, see set_feature_cache.
+static feature_cache *corner_cache = 0;
+
+// Make detect_corners look features up in a cache before detecting them.
+// feature_cache *fc: cache to use, 0 to stop caching. Must stay alive
+//                    while it is set.
+void set_feature_cache(feature_cache *fc)
+{
+    corner_cache = fc;
+}
+
+// Detect corners with a given detector.
+// With FAST, the segment test decides what is a corner, thresh is not
+// used, and sigma is the Harris window the survivors are ranked by for nms.
+// int detector: DETECTOR_HARRIS, DETECTOR_FAST9 or DETECTOR_FAST12.
+// float fast_thresh: intensity threshold of the FAST segment test.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// int *n: pointer to number of corners detected, should fill in.
+// returns: array of descriptors of the corners in the image.
+descriptor *run_corner_detector(image im, int detector, float fast_thresh, float sigma, float thresh, int nms, int *n)
+{
+    if(detector == DETECTOR_FAST9){
+        return fast_corner_detector(im, fast_thresh, 9, nms, sigma, n);
+    }
+    if(detector == DETECTOR_FAST12){
+        return fast_corner_detector(im, fast_thresh, 12, nms, sigma, n);
+    }
+    return harris_corner_detector(im, sigma, thresh, nms, n);
+}
+
+// Detect corners with the detector picked by set_corner_detector, through
+// the cache picked by set_feature_cache if there is one.
+descriptor *detect_corners(image im, float sigma, float thresh, int nms, int *n)
+{
+    if(corner_cache){
+        return feature_cache_detect(corner_cache, im, corner_detector, corner_fast_thresh,
+                sigma, thresh, nms, n);
+    }
+    return run_corner_detector(im, corner_detector, corner_fast_thresh, sigma, thresh, nms, n);
+}
+
 // Find and draw corners on an image.
 // image im: input image.
 // float sigma: std. dev for harris.
@@ -251,6 +564,6 @@ descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms,
 void detect_and_draw_corners(image im, float sigma, float thresh, int nms)
 {
     int n = 0;
-    descriptor *d = harris_corner_detector(im, sigma, thresh, nms, &n);
+    descriptor *d = detect_corners(im, sigma, thresh, nms, &n);
     mark_corners(im, d, n);
 }
@@ -1,5 +1,6 @@
 #ifndef IMAGE_H
 #define IMAGE_H
+#include <stddef.h>
 #include "matrix.h"
 #define TWOPI 6.2831853
 
@@ -8,10 +9,24 @@
 
 // DO NOT CHANGE THIS FILE
 
+// An image, one channel after the other.
+// int w, h, c: size of the image.
+// float *data: pixel (x, y) of channel k, see IMAGE_AT.
+// int stride: floats from one row to the next, 0 for w.
+// int pad: rows and columns of replicated pixels kept around the image,
+//          which kernels may read past its edges, see make_padded_image.
+// size_t plane: floats from one channel to the next, 0 for w*h.
 typedef struct{
     int w,h,c;
     float *data;
+    int stride;
+    int pad;
+    size_t plane;
 } image;
+#define IMAGE_STRIDE(im) ((ptrdiff_t)((im).stride ? (im).stride : (im).w))
+#define IMAGE_PLANE(im) ((im).plane ? (im).plane : (size_t)(im).w*(im).h)
+#define IMAGE_PACKED(im) (IMAGE_STRIDE(im) == (im).w && IMAGE_PLANE(im) == (size_t)(im).w*(im).h)
+#define IMAGE_AT(im, x, y, k) ((im).data[(ptrdiff_t)((k)*IMAGE_PLANE(im)) + (y)*IMAGE_STRIDE(im) + (x)])
 
 // A 2d point.
 // float x, y: the coordinates of the point.
@@ -21,10 +36,13 @@ typedef struct{
 
 // A descriptor for a point in an image.
 // point p: x,y coordinates of the image pixel.
+// float scale: how much the image was shrunk when the point was found,
+//              1 for full resolution.
 // int n: the number of floating point values in the descriptor.
 // float *data: the descriptor for the pixel.
 typedef struct{
     point p;
+    float scale;
     int n;
     float *data;
 } descriptor;
@@ -39,10 +57,107 @@ typedef struct{
     float distance;
 } match;
 
+// A large image stored as fixed-size tiles that are allocated on first use.
+// int w, h, c: size of the canvas.
+// int tw, th: number of tiles across and down.
+// float **tiles: tw*th tiles in row-major order, 0 until written.
+// float *map: memory-mapped backing store for the tiles, 0 if on the heap.
+// int fd: file descriptor of the mapped scratch file.
+#define CANVAS_TILE 256
+typedef struct{
+    int w, h, c;
+    int tw, th;
+    float **tiles;
+    float *map;
+    int fd;
+} canvas;
+
+// Rows pulled on demand by the streaming encoders, see save_rows.
+// int w, h, c: size of the image.
+// void *data: passed back to get_row.
+// get_row: fills row with the w values of channel c of row y.
+typedef struct{
+    int w, h, c;
+    void *data;
+    void (*get_row)(void *data, int y, int c, float *row);
+} row_source;
+
+// An image stored in a smaller sample type, see typed_image.c.
+// int dtype: DTYPE_U8, DTYPE_U16, DTYPE_F16 or DTYPE_F32. Integer types
+//            map their full range to [0, 1].
+// void *data: planar samples in the same layout as image.data.
+#define DTYPE_F32 0
+#define DTYPE_U8 1
+#define DTYPE_F16 2
+#define DTYPE_U16 3
+typedef struct{
+    int w, h, c;
+    int dtype;
+    void *data;
+} typed_image;
+
+// A precomputed per-pixel lookup into a source image of the same size.
+// int w, h: size of the source and output images.
+// unsigned int *off: offset of the top left bilinear sample of each output
+//                    pixel in a source channel, REMAP_NONE if it has none.
+// unsigned short *fx, *fy: bilinear weights of the right and bottom
+//                          samples in Q15 fixed point (32768 == 1).
+#define REMAP_NONE 0xffffffffu
+typedef struct{
+    int w, h;
+    unsigned int *off;
+    unsigned short *fx, *fy;
+} remap;
+
+// Reusable state for encoding images to files, see write_image.
+// char *name: file name with extension of the last image.
+typedef struct{
+    char *name;
+    size_t name_size;
+} image_writer;
+
+// Loads a list of files on a pool of threads, see make_image_loader.
+typedef struct image_loader image_loader;
+
+// Saves images on background threads, see make_image_saver.
+typedef struct image_saver image_saver;
+
+// Memory released all at once instead of piece by piece, see make_arena.
+typedef struct arena arena;
+
+// How far an arena had been filled, see arena_mark.
+typedef struct{
+    arena *a;
+    void *block;
+    size_t used;
+} arena_pos;
+
+// Detected features stored on disk, see feature_cache_detect.
+// char *dir: directory holding the entries.
+// int hits, misses: lookups that found an entry and lookups that didn't.
+typedef struct{
+    char *dir;
+    int hits, misses;
+} feature_cache;
+
+// A Gaussian pyramid, each level half the size of the one before.
+// int levels: number of levels, level 0 is the base image.
+// int built: number of levels computed so far.
+// float *arena: single allocation holding every level but the base.
+// image level[]: the levels, only valid below built.
+#define PYRAMID_MAX_LEVELS 16
+typedef struct{
+    int levels, built;
+    float *arena;
+    image level[PYRAMID_MAX_LEVELS];
+} image_pyramid;
+
 // Basic operations
 float get_pixel(image im, int x, int y, int c);
 void set_pixel(image im, int x, int y, int c, float v);
 image copy_image(image im);
+void copy_image_into(image im, image out);
+image image_view(image im, int x, int y, int w, int h);
 image rgb_to_grayscale(image im);
 image grayscale_to_rgb(image im, float r, float g, float b);
 void rgb_to_hsv(image im);
@@ -57,16 +172,84 @@ image add_image(image a, image b);
 
 // Loading and saving
 image make_image(int w, int h, int c);
+image make_padded_image(int w, int h, int c, int pad);
+image pad_image(image im, int pad);
+void replicate_border(image im);
 image load_image(char *filename);
+image load_image_stb(char *filename, int channels);
+int try_load_image_stb(char *filename, int channels, image *im);
+image load_image_scaled(char *filename, int denom);
 void save_image(image im, const char *name);
 void save_png(image im, const char *name);
 void free_image(image im);
+image_writer make_image_writer();
+void free_image_writer(image_writer *w);
+int write_image(image_writer *w, image im, const char *name, int png);
+image_loader *make_image_loader(char **files, int n, int threads, int queue);
+int image_loader_next(image_loader *l, image *im);
+void free_image_loader(image_loader *l);
+int load_images(char **files, int n, int threads, image *ims);
+image_saver *make_image_saver(int threads, int queue);
+void image_saver_submit(image_saver *s, image im, const char *name, int png);
+int image_saver_wait(image_saver *s);
+void free_image_saver(image_saver *s);
+#define RAW_F32 DTYPE_F32
+#define RAW_U8 DTYPE_U8
+#define RAW_F16 DTYPE_F16
+int save_image_raw(image im, const char *name, int dtype);
+image load_image_raw(const char *filename);
+void free_image_raw(image im);
+float half_to_float(unsigned short h);
+row_source image_rows(image *im);
+int save_rows(row_source src, const char *name, int png);
+int save_rows_file(row_source src, const char *filename, int png);
+#define PNG_FILTER_NONE 0
+#define PNG_FILTER_SUB 1
+#define PNG_FILTER_UP 2
+#define PNG_FILTER_AVG 3
+#define PNG_FILTER_PAETH 4
+#define PNG_FILTER_ADAPTIVE 5
+void set_png_options(int level, int filter, int threads);
+
+// Typed images
+typed_image make_typed_image(int w, int h, int c, int dtype);
+void free_typed_image(typed_image im);
+void typed_get_row(typed_image im, int y, int c, float *row);
+void typed_set_row(typed_image im, int y, int c, const float *row);
+typed_image image_to_typed(image im, int dtype);
+image typed_to_image(typed_image t);
+row_source typed_rows(typed_image *im);
+typed_image load_image_typed(char *filename, int dtype);
+typed_image convolve_typed(typed_image im, image filter, int preserve);
+typed_image filtered_resize_typed(typed_image im, int w, int h, int filter);
+typed_image rgb_to_grayscale_typed(typed_image im);
+unsigned short float_to_half(float f);
+
+// Arenas
+arena *make_arena(size_t size);
+void free_arena(arena *a);
+void arena_reset(arena *a);
+int arena_grows(arena *a);
+size_t arena_size(arena *a);
+arena_pos arena_mark();
+void arena_rewind(arena_pos p);
+arena *use_arena(arena *a);
+int arena_owns(const void *p);
+void *arena_calloc(size_t n, size_t size);
+void arena_free(void *p);
 
 // Resizing
 float nn_interpolate(image im, float x, float y, int c);
 image nn_resize(image im, int w, int h);
 float bilinear_interpolate(image im, float x, float y, int c);
 image bilinear_resize(image im, int w, int h);
+#define RESIZE_BOX 0
+#define RESIZE_TRIANGLE 1
+#define RESIZE_BICUBIC 2
+#define RESIZE_LANCZOS3 3
+image filtered_resize(image im, int w, int h, int filter);
+void bilinear_resize_u8(const unsigned char *src, int sw, int sh, int c, unsigned char *dst, int dw, int dh);
+int resize_image_file(char *in, const char *out, int w, int h);
 
 // Filtering
 image convolve_image(image im, image filter, int preserve);
@@ -84,19 +267,80 @@ image *sobel_image(image im);
 image colorize_sobel(image im);
 image smooth_image(image im, float sigma);
 
+// Pyramids
+void pyramid_reduce_into(image im, image out);
+image pyramid_reduce(image im);
+image pyramid_expand(image im, int w, int h);
+image_pyramid make_image_pyramid(image im, int levels);
+image pyramid_level(image_pyramid *p, int i);
+void free_image_pyramid(image_pyramid p);
+
 // Harris and Stitching
 image structure_matrix(image im, float sigma);
 image cornerness_response(image S);
 void free_descriptors(descriptor *d, int n);
+descriptor describe_index(image im, int i);
 image cylindrical_project(image im, float f);
 void mark_corners(image im, descriptor *d, int n);
 image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms);
+image both_images(image a, image b);
 void detect_and_draw_corners(image im, float sigma, float thresh, int nms);
+point make_point(float x, float y);
+point project_point(matrix H, point p);
 int model_inliers(matrix H, match *m, int n, float thresh);
+matrix compute_homography(match *matches, int n);
+matrix RANSAC(match *m, int n, float thresh, int k, int cutoff);
+void combine_extent(image a, image b, matrix H, int *dx, int *dy, int *w, int *h);
 image combine_images(image a, image b, matrix H);
+canvas combine_images_canvas(image a, image b, matrix H, const char *scratch);
 match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn);
 descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n);
+image harris_response(image im, float sigma);
+point refine_corner(image R, int x, int y);
+descriptor *harris_pyramid_detector(image_pyramid *p, float sigma, float thresh, int nms, int *n);
+descriptor *harris_corner_detector_multiscale(image im, float sigma, float thresh, int nms, int levels, int *n);
+descriptor *fast_corner_detector(image im, float t, int arc, int nms, float sigma, int *n);
+#define DETECTOR_HARRIS 0
+#define DETECTOR_FAST9 1
+#define DETECTOR_FAST12 2
+void set_corner_detector(int detector, float fast_thresh);
+descriptor *detect_corners(image im, float sigma, float thresh, int nms, int *n);
+descriptor *run_corner_detector(image im, int detector, float fast_thresh, float sigma, float thresh, int nms, int *n);
+feature_cache make_feature_cache(const char *dir);
+void free_feature_cache(feature_cache *fc);
+void clear_feature_cache(feature_cache *fc);
+descriptor *feature_cache_detect(feature_cache *fc, image im, int detector, float fast_thresh, float sigma, float thresh, int nms, int *n);
+void set_feature_cache(feature_cache *fc);
 image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff);
+void set_debug_output(int on, image_saver *saver);
+void set_panorama_arena(arena *a);
+void set_panorama_levels(int levels);
+
+// Warping
+void warp_rect(image src, matrix H, float *dst, int stride, int plane, float *mask, int ox, int oy, int tw, int th);
+void warp_image_into(image dst, image src, matrix H, int dx, int dy);
+void warp_canvas_into(canvas cv, image src, matrix H, int dx, int dy);
+remap make_cylindrical_remap(int w, int h, float f);
+void remap_image_into(remap m, image im, image out);
+image remap_image(remap m, image im);
+void free_remap(remap m);
+
+// Blending
+#define BLEND_OVERWRITE 0
+#define BLEND_FEATHER 1
+#define BLEND_MULTIBAND 2
+image combine_images_blend(image a, image b, matrix H, int mode);
+
+// Canvas
+canvas make_canvas(int w, int h, int c, const char *scratch);
+void free_canvas(canvas cv);
+float *canvas_tile(canvas cv, int tx, int ty);
+void canvas_paste(canvas cv, image im, int x, int y);
+void canvas_get_row(canvas cv, int y, int c, float *row);
+image canvas_to_image(canvas cv);
+void save_canvas(canvas cv, const char *name);
+row_source canvas_rows(canvas *cv);
+int save_canvas_image(canvas cv, const char *name, int png);
 
 #endif
 
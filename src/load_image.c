@@ -1,12 +1,14 @@
 // You probably don't want to edit this file
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
 
 #include "image.h"
 
 image make_empty_image(int w, int h, int c)
 {
-    image out;
+    image out = {0};
     out.data = 0;
     out.h = h;
     out.w = w;
@@ -17,7 +19,40 @@ image make_empty_image(int w, int h, int c)
 image make_image(int w, int h, int c)
 {
     image out = make_empty_image(w,h,c);
-    out.data = calloc(h*w*c, sizeof(float));
+    out.data = arena_calloc((size_t)h*w*c, sizeof(float));
+    return out;
+}
+
+// Floats before pixel (0, 0) of a padded image: the rows of the top
+// border, and enough of the left border to keep pixel (0, 0) aligned.
+static size_t padded_offset(image im)
+{
+    if(!im.pad) return 0;
+    return (size_t)im.pad*IMAGE_STRIDE(im) + ((im.pad + 15) & ~15);
+}
+
+// Make an image laid out for vector code. Rows start on 64-byte
+// boundaries and are padded out to a multiple of 16 floats, avoiding
+// strides that are a multiple of 2K so rows don't alias in the cache. The
+// image is surrounded by pad rows and columns that replicate_border fills
+// with copies of the edge pixels, so a kernel no wider than 2*pad+1 can
+// read past the edges without clamping.
+// int w, h, c: size of the image, not counting the border.
+// int pad: width of the border on each side, may be 0.
+// returns: zeroed image, free with free_image.
+image make_padded_image(int w, int h, int c, int pad)
+{
+    image out = make_empty_image(w, h, c);
+    int left = (pad + 15) & ~15;
+    int stride = (left + w + pad + 15) & ~15;
+    if(stride % 512 == 0) stride += 16;
+    size_t plane = (size_t)stride*(h + 2*pad);
+    if(plane % 512 == 0) plane += 16;
+    out.stride = stride;
+    out.pad = pad;
+    out.plane = plane;
+    float *base = arena_calloc(padded_offset(out) + c*plane, sizeof(float));
+    out.data = base + padded_offset(out);
     return out;
 }
 
@@ -26,26 +61,44 @@ image make_image(int w, int h, int c)
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-void save_image_stb(image im, const char *name, int png)
+image_writer make_image_writer()
 {
-    char buff[256];
-    unsigned char *data = calloc(im.w*im.h*im.c, sizeof(char));
-    int i,k;
-    for(k = 0; k < im.c; ++k){
-        for(i = 0; i < im.w*im.h; ++i){
-            data[i*im.c+k] = (unsigned char) roundf((255*im.data[i + k*im.w*im.h]));
-        }
-    }
-    int success = 0;
-    if(png){
-        sprintf(buff, "%s.png", name);
-        success = stbi_write_png(buff, im.w, im.h, im.c, data, im.w*im.c);
-    } else {
-        sprintf(buff, "%s.jpg", name);
-        success = stbi_write_jpg(buff, im.w, im.h, im.c, data, 100);
+    image_writer w = {0};
+    return w;
+}
+
+void free_image_writer(image_writer *w)
+{
+    free(w->name);
+    *w = make_image_writer();
+}
+
+// Encode and write an image. Both formats are streamed a few rows at a
+// time by save_rows_file, PNGs with the settings of set_png_options, so
+// no interleaved copy of the image is made. The writer keeps the file
+// name buffer from one image to the next.
+// image_writer *w: writer to use.
+// image im: image to write, values are clamped to [0, 1].
+// const char *name: file name without extension.
+// int png: 1 for "<name>.png", 0 for "<name>.jpg".
+// returns: 1 on success, 0 if the file could not be written.
+int write_image(image_writer *w, image im, const char *name, int png)
+{
+    size_t len = strlen(name) + 5;
+    if(len > w->name_size){
+        free(w->name);
+        w->name = malloc(len);
+        w->name_size = len;
     }
-    free(data);
-    if(!success) fprintf(stderr, "Failed to write image %s\n", buff);
+    sprintf(w->name, "%s.%s", name, png ? "png" : "jpg");
+    return save_rows_file(image_rows(&im), w->name, png);
+}
+
+void save_image_stb(image im, const char *name, int png)
+{
+    image_writer w = make_image_writer();
+    write_image(&w, im, name, png);
+    free_image_writer(&w);
 }
 
 void save_png(image im, const char *name)
@@ -58,6 +111,62 @@ void save_image(image im, const char *name)
     save_image_stb(im, name, 0);
 }
 
+// Convert interleaved 8-bit pixels to planar floats in [0, 1].
+// Each channel count has its own loop with a constant stride and no
+// per-sample index math, so the compiler can turn it into vector shuffles,
+// widens and a multiply by 1/255.
+// const unsigned char *src: n pixels with c interleaved channels.
+// int keep: number of leading channels to write, extra ones are skipped.
+// float *dst: keep planes of n floats.
+static void deinterleave_u8(const unsigned char *restrict src, int n, int c, int keep, float *restrict dst)
+{
+    const float s = 1.f/255;
+    float *restrict d0 = dst, *restrict d1 = dst + n, *restrict d2 = dst + 2*n;
+    int i, k;
+    if(c == 1){
+        for(i = 0; i < n; ++i) d0[i] = src[i]*s;
+    } else if(c == 3 && keep == 3){
+        for(i = 0; i < n; ++i){
+            d0[i] = src[3*i]*s;
+            d1[i] = src[3*i+1]*s;
+            d2[i] = src[3*i+2]*s;
+        }
+    } else if(c == 4 && keep == 3){
+        for(i = 0; i < n; ++i){
+            d0[i] = src[4*i]*s;
+            d1[i] = src[4*i+1]*s;
+            d2[i] = src[4*i+2]*s;
+        }
+    } else {
+        for(k = 0; k < keep; ++k){
+            for(i = 0; i < n; ++i) dst[k*n + i] = src[c*i + k]*s;
+        }
+    }
+}
+
+// Load an image using stb, without giving up on failure.
+// char *filename: file to load.
+// int channels: channels > 0 forces the image to have that many channels.
+// image *im: filled in with the image.
+// returns: 1 on success, 0 if the file could not be read (the reason is
+//          printed, im is left alone).
+int try_load_image_stb(char *filename, int channels, image *im)
+{
+    int w, h, c;
+    unsigned char *data = stbi_load(filename, &w, &h, &c, channels);
+    if (!data) {
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
+            filename, stbi_failure_reason());
+        return 0;
+    }
+    if (channels) c = channels;
+    //We don't like alpha channels, #YOLO
+    *im = make_image(w, h, c == 4 ? 3 : c);
+    deinterleave_u8(data, w*h, c, im->c, im->data);
+    free(data);
+    return 1;
+}
+
 // 
 // Load an image using stb
 // channels = [0..4]
@@ -65,38 +174,95 @@ void save_image(image im, const char *name)
 //
 image load_image_stb(char *filename, int channels)
 {
+    image im;
+    if(!try_load_image_stb(filename, channels, &im)) exit(0);
+    return im;
+}
+
+image load_image(char *filename)
+{
+    image out = load_image_stb(filename, 0);
+    return out;
+}
+
+// Load an image at a fraction of its size. Each output pixel is the
+// average of a denom x denom block of decoded pixels, the same thing
+// decoding only the low frequency DCT coefficients of a JPEG gives. The
+// blocks are summed in 8 bits straight from the decoder's buffer, so the
+// full size float image load_image would make is never allocated.
+// char *filename: file to load.
+// int denom: 1, 2, 4 or 8, the image is shrunk by this factor.
+// returns: ceil(w/denom) x ceil(h/denom) image, alpha dropped like
+//          load_image. Has data == 0 if the file could not be loaded,
+//          unlike load_image this does not exit.
+image load_image_scaled(char *filename, int denom)
+{
+    assert(denom == 1 || denom == 2 || denom == 4 || denom == 8);
+    image im = {0};
+    if(denom == 1){
+        try_load_image_stb(filename, 0, &im);
+        return im;
+    }
     int w, h, c;
-    unsigned char *data = stbi_load(filename, &w, &h, &c, channels);
+    unsigned char *data = stbi_load(filename, &w, &h, &c, 0);
     if (!data) {
         fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
             filename, stbi_failure_reason());
-        exit(0);
+        return im;
     }
-    if (channels) c = channels;
-    int i,j,k;
-    image im = make_image(w, h, c);
-    for(k = 0; k < c; ++k){
-        for(j = 0; j < h; ++j){
-            for(i = 0; i < w; ++i){
-                int dst_index = i + w*j + w*h*k;
-                int src_index = k + c*i + c*w*j;
-                im.data[dst_index] = (float)data[src_index]/255.;
+    int ow = (w + denom - 1)/denom;
+    int oh = (h + denom - 1)/denom;
+    im = make_image(ow, oh, c == 4 ? 3 : c);
+    unsigned int *acc = calloc(ow*c, sizeof(unsigned int));
+    int x, y, k, j;
+    for(y = 0; y < oh; ++y){
+        int y0 = y*denom, y1 = MIN(y0 + denom, h);
+        memset(acc, 0, ow*c*sizeof(unsigned int));
+        for(j = y0; j < y1; ++j){
+            const unsigned char *row = data + (size_t)j*w*c;
+            for(x = 0; x < w; ++x){
+                unsigned int *a = acc + (x/denom)*c;
+                for(k = 0; k < c; ++k) a[k] += row[x*c + k];
             }
         }
+        for(x = 0; x < ow; ++x){
+            int n = (MIN((x+1)*denom, w) - x*denom)*(y1 - y0);
+            float s = 1.f/(255*n);
+            for(k = 0; k < im.c; ++k) im.data[k*ow*oh + y*ow + x] = acc[x*c + k]*s;
+        }
     }
-    //We don't like alpha channels, #YOLO
-    if(im.c == 4) im.c = 3;
+    free(acc);
     free(data);
     return im;
 }
 
-image load_image(char *filename)
+// Resize an image file straight to another file, staying in 8 bits.
+// char *in: file to read.
+// const char *out: file to write, ".jpg" is appended like save_image.
+// int w, h: size of the result.
+// returns: 1 on success, 0 if the file could not be read or written.
+int resize_image_file(char *in, const char *out, int w, int h)
 {
-    image out = load_image_stb(filename, 0);
-    return out;
+    int sw, sh, c;
+    unsigned char *data = stbi_load(in, &sw, &sh, &c, 0);
+    if (!data) {
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
+            in, stbi_failure_reason());
+        return 0;
+    }
+    unsigned char *res = calloc((size_t)w*h*c, sizeof(char));
+    bilinear_resize_u8(data, sw, sh, c, res, w, h);
+    free(data);
+    char *buff = malloc(strlen(out) + 5);
+    sprintf(buff, "%s.jpg", out);
+    int success = stbi_write_jpg(buff, w, h, c, res, 100);
+    free(res);
+    if(!success) fprintf(stderr, "Failed to write image %s\n", buff);
+    free(buff);
+    return success;
 }
 
 void free_image(image im)
 {
-    free(im.data);
+    if(im.data) arena_free(im.data - padded_offset(im));
 }
@@ -1,4 +1,5 @@
 #include "matrix.h"
+#include "image.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,8 +26,8 @@ matrix make_translation_homography(float dx, float dy)
 void free_matrix(matrix m)
 {
     int i;
-    for(i = 0; i < m.rows; ++i) free(m.data[i]);
-    free(m.data);
+    for(i = 0; i < m.rows; ++i) arena_free(m.data[i]);
+    arena_free(m.data);
 }
 
 matrix make_matrix(int rows, int cols)
@@ -34,9 +35,9 @@ matrix make_matrix(int rows, int cols)
     matrix m;
     m.rows = rows;
     m.cols = cols;
-    m.data = calloc(m.rows, sizeof(double *));
+    m.data = arena_calloc(m.rows, sizeof(double *));
     int i;
-    for(i = 0; i < m.rows; ++i) m.data[i] = calloc(m.cols, sizeof(double));
+    for(i = 0; i < m.rows; ++i) m.data[i] = arena_calloc(m.cols, sizeof(double));
     return m;
 }
 
@@ -111,10 +112,10 @@ matrix transpose_matrix(matrix m)
     matrix t;
     t.rows = m.cols;
     t.cols = m.rows;
-    t.data = calloc(t.rows, sizeof(double *));
+    t.data = arena_calloc(t.rows, sizeof(double *));
     int i, j;
     for(i = 0; i < t.rows; ++i){
-        t.data[i] = calloc(t.cols, sizeof(double));
+        t.data[i] = arena_calloc(t.cols, sizeof(double));
         for(j = 0; j < t.cols; ++j){
             t.data[i][j] = m.data[j][i];
         }
@@ -225,7 +226,7 @@ matrix matrix_invert(matrix m)
             c.data[k][j] /= val;
         }
         for(i = k+1; i < c.rows; ++i){
-            float s = -c.data[i][k];
+            double s = -c.data[i][k];
             c.data[i][k] = 0;
             for(j = k+1; j < c.cols; ++j){
                 c.data[i][j] +=  s*c.data[k][j];
@@ -314,17 +315,154 @@ double *sle_solve(matrix A, double *b)
     return LUP_solve(A, A, p, b);
 }
 
+lsq make_lsq(int n, int m)
+{
+    lsq s;
+    s.n = n;
+    s.m = m;
+    s.AtA = make_matrix(n, n);
+    s.Atb = make_matrix(n, m);
+    return s;
+}
+
+void free_lsq(lsq s)
+{
+    free_matrix(s.AtA);
+    free_matrix(s.Atb);
+}
+
+// Fold one row of M (and the matching row of b) into the normal equations.
+// Only the upper triangle of AtA is touched, zero entries are skipped.
+void lsq_add_row(lsq s, const double *row, const double *b)
+{
+    int i, j, k;
+    for(i = 0; i < s.n; ++i){
+        double ri = row[i];
+        if(ri == 0) continue;
+        double *AtAi = s.AtA.data[i];
+        for(j = i; j < s.n; ++j){
+            AtAi[j] += ri*row[j];
+        }
+        for(k = 0; k < s.m; ++k){
+            s.Atb.data[i][k] += ri*b[k];
+        }
+    }
+}
+
+// Cholesky factorization A = R^T R of a symmetric positive definite matrix.
+// Reads only the upper triangle and overwrites it with R.
+// returns: 1 on success, 0 if A is not (numerically) positive definite.
+int cholesky_in_place(matrix A)
+{
+    assert(A.rows == A.cols);
+    int i, j, k;
+    double maxd = 0;
+    for(i = 0; i < A.rows; ++i) maxd = fmax(maxd, fabs(A.data[i][i]));
+    double tol = maxd*1e-12;
+    for(k = 0; k < A.rows; ++k){
+        double *Rk = A.data[k];
+        double d = Rk[k];
+        for(i = 0; i < k; ++i) d -= A.data[i][k]*A.data[i][k];
+        if(!(d > tol)) return 0;
+        d = sqrt(d);
+        Rk[k] = d;
+        for(j = k+1; j < A.cols; ++j){
+            double v = Rk[j];
+            for(i = 0; i < k; ++i) v -= A.data[i][k]*A.data[i][j];
+            Rk[j] = v/d;
+        }
+    }
+    return 1;
+}
+
+// Solve the accumulated system with Cholesky, in place.
+// On success AtA holds the factor and Atb holds the n x m solution.
+// returns: 1 on success, 0 if M^T M is singular.
+int lsq_solve(lsq s)
+{
+    int i, j, k;
+    if(!cholesky_in_place(s.AtA)) return 0;
+    double **R = s.AtA.data;
+    double **x = s.Atb.data;
+    for(k = 0; k < s.m; ++k){
+        for(i = 0; i < s.n; ++i){
+            double v = x[i][k];
+            for(j = 0; j < i; ++j) v -= R[j][i]*x[j][k];
+            x[i][k] = v/R[i][i];
+        }
+        for(i = s.n-1; i >= 0; --i){
+            double v = x[i][k];
+            for(j = i+1; j < s.n; ++j) v -= R[i][j]*x[j][k];
+            x[i][k] = v/R[i][i];
+        }
+    }
+    return 1;
+}
+
+// Least squares via Householder QR. Better conditioned than the normal
+// equations but needs all of M. Overwrites both M and b.
+// returns: M.cols x b.cols solution, empty matrix if M is rank deficient.
+matrix qr_solve_in_place(matrix M, matrix b)
+{
+    matrix none = {0};
+    assert(M.rows == b.rows);
+    if(M.cols <= 0 || M.rows < M.cols) return none;
+    int i, j, k;
+    for(k = 0; k < M.cols; ++k){
+        double norm = 0;
+        for(i = k; i < M.rows; ++i) norm += M.data[i][k]*M.data[i][k];
+        norm = sqrt(norm);
+        if(norm == 0) return none;
+        double alpha = M.data[k][k] > 0 ? -norm : norm;
+        // v = x - alpha*e1, stored in place of column k
+        M.data[k][k] -= alpha;
+        double vtv = 0;
+        for(i = k; i < M.rows; ++i) vtv += M.data[i][k]*M.data[i][k];
+        for(j = k+1; j < M.cols; ++j){
+            double dot = 0;
+            for(i = k; i < M.rows; ++i) dot += M.data[i][k]*M.data[i][j];
+            double f = 2*dot/vtv;
+            for(i = k; i < M.rows; ++i) M.data[i][j] -= f*M.data[i][k];
+        }
+        for(j = 0; j < b.cols; ++j){
+            double dot = 0;
+            for(i = k; i < M.rows; ++i) dot += M.data[i][k]*b.data[i][j];
+            double f = 2*dot/vtv;
+            for(i = k; i < M.rows; ++i) b.data[i][j] -= f*M.data[i][k];
+        }
+        M.data[k][k] = alpha;
+    }
+    double maxd = 0;
+    for(k = 0; k < M.cols; ++k) maxd = fmax(maxd, fabs(M.data[k][k]));
+    for(k = 0; k < M.cols; ++k){
+        if(fabs(M.data[k][k]) <= maxd*1e-12) return none;
+    }
+    matrix x = make_matrix(M.cols, b.cols);
+    for(j = 0; j < b.cols; ++j){
+        for(i = M.cols-1; i >= 0; --i){
+            double v = b.data[i][j];
+            for(k = i+1; k < M.cols; ++k) v -= M.data[i][k]*x.data[k][j];
+            x.data[i][j] = v/M.data[i][i];
+        }
+    }
+    return x;
+}
+
 matrix solve_system(matrix M, matrix b)
 {
     matrix none = {0};
-    matrix Mt = transpose_matrix(M);
-    matrix MtM = matrix_mult_matrix(Mt, M);
-    matrix MtMinv = matrix_invert(MtM);
-    if(!MtMinv.data) return none;
-    matrix Mdag = matrix_mult_matrix(MtMinv, Mt);
-    matrix a = matrix_mult_matrix(Mdag, b);
-    free_matrix(Mt); free_matrix(MtM); free_matrix(MtMinv); free_matrix(Mdag);
-    return a;
+    assert(M.rows == b.rows);
+    lsq s = make_lsq(M.cols, b.cols);
+    int i;
+    for(i = 0; i < M.rows; ++i){
+        lsq_add_row(s, M.data[i], b.data[i]);
+    }
+    if(!lsq_solve(s)){
+        free_lsq(s);
+        return none;
+    }
+    free_matrix(s.AtA);
+    return s.Atb;
 }
 
 void test_matrix()
@@ -12,6 +12,19 @@ typedef struct LUP{
     int n;
 } LUP;
 
+// Streaming least-squares accumulator for min ||Mx - b||.
+// Rows of M are folded into the normal equations as they arrive,
+// so M and M^T are never materialized.
+// int n: number of unknowns (columns of M).
+// int m: number of right-hand sides (columns of b).
+// matrix AtA: n x n, upper triangle of M^T M.
+// matrix Atb: n x m, M^T b. Holds the solution after lsq_solve.
+typedef struct lsq{
+    int n, m;
+    matrix AtA;
+    matrix Atb;
+} lsq;
+
 matrix make_identity_homography();
 matrix make_translation_homography(float dx, float dy);
 
@@ -24,4 +37,11 @@ double **n_principal_components(matrix m, int n);
 void test_matrix();
 matrix solve_system(matrix M, matrix b);
 matrix matrix_invert(matrix m);
+
+lsq make_lsq(int n, int m);
+void free_lsq(lsq s);
+void lsq_add_row(lsq s, const double *row, const double *b);
+int lsq_solve(lsq s);
+int cholesky_in_place(matrix A);
+matrix qr_solve_in_place(matrix M, matrix b);
 #endif
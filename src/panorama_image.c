@@ -34,21 +34,8 @@ point make_point(float x, float y)
 image both_images(image a, image b)
 {
     image both = make_image(a.w + b.w, a.h > b.h ? a.h : b.h, a.c > b.c ? a.c : b.c);
-    int i,j,k;
-    for(k = 0; k < a.c; ++k){
-        for(j = 0; j < a.h; ++j){
-            for(i = 0; i < a.w; ++i){
-                set_pixel(both, i, j, k, get_pixel(a, i, j, k));
-            }
-        }
-    }
-    for(k = 0; k < b.c; ++k){
-        for(j = 0; j < b.h; ++j){
-            for(i = 0; i < b.w; ++i){
-                set_pixel(both, i+a.w, j, k, get_pixel(b, i, j, k));
-            }
-        }
-    }
+    copy_image_into(a, image_view(both, 0, 0, a.w, a.h));
+    copy_image_into(b, image_view(both, a.w, 0, b.w, b.h));
     return both;
 }
 
@@ -97,8 +84,8 @@ image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms
     int an = 0;
     int bn = 0;
     int mn = 0;
-    descriptor *ad = harris_corner_detector(a, sigma, thresh, nms, &an);
-    descriptor *bd = harris_corner_detector(b, sigma, thresh, nms, &bn);
+    descriptor *ad = detect_corners(a, sigma, thresh, nms, &an);
+    descriptor *bd = detect_corners(b, sigma, thresh, nms, &bn);
     match *m = match_descriptors(ad, an, bd, bn, &mn);
 
     mark_corners(a, ad, an);
@@ -107,7 +94,7 @@ image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms
 
     free_descriptors(ad, an);
     free_descriptors(bd, bn);
-    free(m);
+    arena_free(m);
     return lines;
 }
 
@@ -136,7 +123,7 @@ match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
 
     // We will have at most an matches.
     *mn = an;
-    match *m = calloc(an, sizeof(match));
+    match *m = arena_calloc(an, sizeof(match));
     for(j = 0; j < an; ++j){
         // TODO: for every descriptor in a, find best match in b.
         // record ai as the index in *a and bi as the index in *b.
@@ -149,7 +136,7 @@ match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
     }
 
     int count = 0;
-    int *seen = calloc(bn, sizeof(int));
+    int *seen = arena_calloc(bn, sizeof(int));
     // TODO: we want matches to be injective (one-to-one).
     // Sort matches based on distance using match_compare and qsort.
     // Then throw out matches to the same element in b. Use seen to keep track.
@@ -157,7 +144,7 @@ match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
     // Some points will not be in a match.
     // In practice just bring good matches to front of list, set *mn.
     *mn = count;
-    free(seen);
+    arena_free(seen);
     return m;
 }
 
@@ -167,11 +154,10 @@ match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
 // returns: point projected using the homography.
 point project_point(matrix H, point p)
 {
-    matrix c = make_matrix(3, 1);
-    // TODO: project point p with homography H.
-    // Remember that homogeneous coordinates are equivalent up to scalar.
-    // Have to divide by.... something...
-    point q = make_point(0, 0);
+    double x = H.data[0][0]*p.x + H.data[0][1]*p.y + H.data[0][2];
+    double y = H.data[1][0]*p.x + H.data[1][1]*p.y + H.data[1][2];
+    double w = H.data[2][0]*p.x + H.data[2][1]*p.y + H.data[2][2];
+    point q = make_point(x/w, y/w);
     return q;
 }
 
@@ -218,8 +204,9 @@ void randomize_matches(match *m, int n)
 // returns: matrix representing homography H that maps image a to image b.
 matrix compute_homography(match *matches, int n)
 {
-    matrix M = make_matrix(n*2, 8);
-    matrix b = make_matrix(n*2, 1);
+    // Each match contributes two rows of the 2n x 8 system M a = b.
+    // They are folded straight into the normal equations, M is never built.
+    lsq s = make_lsq(8, 1);
 
     int i;
     for(i = 0; i < n; ++i){
@@ -227,21 +214,27 @@ matrix compute_homography(match *matches, int n)
         double xp = matches[i].q.x;
         double y  = matches[i].p.y;
         double yp = matches[i].q.y;
-        // TODO: fill in the matrices M and b.
-
+        double rx[8] = {x, y, 1, 0, 0, 0, -x*xp, -y*xp};
+        double ry[8] = {0, 0, 0, x, y, 1, -x*yp, -y*yp};
+        lsq_add_row(s, rx, &xp);
+        lsq_add_row(s, ry, &yp);
     }
-    matrix a = solve_system(M, b);
-    free_matrix(M); free_matrix(b); 
 
     // If a solution can't be found, return empty matrix;
     matrix none = {0};
-    if(!a.data) return none;
+    if(!lsq_solve(s)){
+        free_lsq(s);
+        return none;
+    }
+    matrix a = s.Atb;
 
     matrix H = make_matrix(3, 3);
-    // TODO: fill in the homography H based on the result in a.
-
+    for(i = 0; i < 8; ++i){
+        H.data[i/3][i%3] = a.data[i][0];
+    }
+    H.data[2][2] = 1;
 
-    free_matrix(a);
+    free_lsq(s);
     return H;
 }
 
@@ -254,27 +247,39 @@ matrix compute_homography(match *matches, int n)
 // returns: matrix representing most common homography between matches.
 matrix RANSAC(match *m, int n, float thresh, int k, int cutoff)
 {
-    int e;
+    int e, i, j;
     int best = 0;
     matrix Hb = make_translation_homography(256, 0);
-    // TODO: fill in RANSAC algorithm.
-    // for k iterations:
-    //     shuffle the matches
-    //     compute a homography with a few matches (how many??)
-    //     if new homography is better than old (how can you tell?):
-    //         compute updated homography using all inliers
-    //         remember it and how good it is
-    //         if it's better than the cutoff:
-    //             return it immediately
-    // if we get to the end return the best homography
+    for(e = 0; e < k && n >= 4; ++e){
+        // Homographies of an iteration are given back to the arena in use
+        // at its end, the best one is copied into Hb.
+        arena_pos mark = arena_mark();
+        randomize_matches(m, n);
+        matrix H = compute_homography(m, 4);
+        int inliers = H.data ? model_inliers(H, m, n, thresh) : 0;
+        if(inliers > best && inliers >= 4){
+            // Refit to all the inliers, keep it if it is still the best
+            matrix Hi = compute_homography(m, inliers);
+            int fit = Hi.data ? model_inliers(Hi, m, n, thresh) : 0;
+            if(fit > best){
+                best = fit;
+                for(j = 0; j < 3; ++j) for(i = 0; i < 3; ++i) Hb.data[j][i] = Hi.data[j][i];
+            }
+            free_matrix(Hi);
+        }
+        free_matrix(H);
+        arena_rewind(mark);
+        if(best > cutoff) break;
+    }
     return Hb;
 }
 
-// Stitches two images together using a projective transformation.
+// Finds the size of the stitched image and where image a sits in it.
 // image a, b: images to stitch.
 // matrix H: homography from image a coordinates to image b coordinates.
-// returns: combined image stitched together.
-image combine_images(image a, image b, matrix H)
+// int *dx, *dy: filled in with the offset of the canvas from image a.
+// int *w, *h: filled in with the size of the canvas.
+void combine_extent(image a, image b, matrix H, int *dx, int *dy, int *w, int *h)
 {
     matrix Hinv = matrix_invert(H);
 
@@ -283,6 +288,7 @@ image combine_images(image a, image b, matrix H)
     point c2 = project_point(Hinv, make_point(b.w-1, 0));
     point c3 = project_point(Hinv, make_point(0, b.h-1));
     point c4 = project_point(Hinv, make_point(b.w-1, b.h-1));
+    free_matrix(Hinv);
 
     // Find top left and bottom right corners of image b warped into image a.
     point topleft, botright;
@@ -292,39 +298,101 @@ image combine_images(image a, image b, matrix H)
     topleft.y = MIN(c1.y, MIN(c2.y, MIN(c3.y, c4.y)));
 
     // Find how big our new image should be and the offsets from image a.
-    int dx = MIN(0, topleft.x);
-    int dy = MIN(0, topleft.y);
-    int w = MAX(a.w, botright.x) - dx;
-    int h = MAX(a.h, botright.y) - dy;
+    *dx = MIN(0, topleft.x);
+    *dy = MIN(0, topleft.y);
+    *w = MAX(a.w, botright.x) - *dx;
+    *h = MAX(a.h, botright.y) - *dy;
+}
+
+// Stitches two images together using a projective transformation.
+// image a, b: images to stitch.
+// matrix H: homography from image a coordinates to image b coordinates.
+// returns: combined image stitched together.
+image combine_images(image a, image b, matrix H)
+{
+    int dx, dy, w, h;
+    combine_extent(a, b, H, &dx, &dy, &w, &h);
 
     // Can disable this if you are making very big panoramas.
     // Usually this means there was an error in calculating H.
+    // combine_images_canvas has no such limit.
     if(w > 7000 || h > 7000){
         fprintf(stderr, "output too big, stopping\n");
         return copy_image(a);
     }
 
-    int i,j,k;
     image c = make_image(w, h, a.c);
     
     // Paste image a into the new image offset by dx and dy.
-    for(k = 0; k < a.c; ++k){
-        for(j = 0; j < a.h; ++j){
-            for(i = 0; i < a.w; ++i){
-                // TODO: fill in.
-            }
-        }
-    }
+    copy_image_into(a, image_view(c, -dx, -dy, a.w, a.h));
 
-    // TODO: Paste in image b as well.
-    // You should loop over some points in the new image (which? all?)
-    // and see if their projection from a coordinates to b coordinates falls
-    // inside of the bounds of image b. If so, use bilinear interpolation to
-    // estimate the value of b at that projection, then fill in image c.
+    // Paste in image b as well. Every pixel of the new image is projected
+    // from a coordinates into b and bilinearly sampled where it lands in b.
+    warp_image_into(c, b, H, dx, dy);
 
     return c;
 }
 
+// Stitches two images together onto a tiled canvas, for panoramas too big
+// to hold as a single image. Only tiles covered by a or b are allocated.
+// image a, b: images to stitch.
+// matrix H: homography from image a coordinates to image b coordinates.
+// const char *scratch: scratch file to back the canvas, 0 to use the heap.
+// returns: canvas with the combined images, tiles == 0 on failure.
+canvas combine_images_canvas(image a, image b, matrix H, const char *scratch)
+{
+    int dx, dy, w, h;
+    combine_extent(a, b, H, &dx, &dy, &w, &h);
+    canvas cv = make_canvas(w, h, a.c, scratch);
+    if(!cv.tiles) return cv;
+    canvas_paste(cv, a, -dx, -dy);
+    warp_canvas_into(cv, b, H, dx, dy);
+    return cv;
+}
+
+// Debug images written by panorama_image, see set_debug_output.
+static int debug_output = 1;
+static image_saver *debug_saver = 0;
+
+// Control the debug images panorama_image writes ("inliers").
+// int on: 0 to skip them entirely, drawing included. Corners are then not
+//         marked on a and b either.
+// image_saver *saver: if not 0, debug images are handed to it and written
+//                     in the background instead of blocking the stitch.
+void set_debug_output(int on, image_saver *saver)
+{
+    debug_output = on;
+    debug_saver = saver;
+}
+
+// Arena panorama_image takes its temporaries from, see set_panorama_arena.
+static arena *panorama_arena = 0;
+
+// Have panorama_image allocate the images, descriptors, matches and
+// matrices of detection, matching and RANSAC from an arena and reset it
+// before returning, so stitching frame after frame stops calling malloc
+// once the arena has grown to fit. The stitched image is still allocated
+// on the heap.
+// arena *a: arena to use, 0 for the heap. Only one thread at a time may
+//           stitch with it.
+void set_panorama_arena(arena *a)
+{
+    panorama_arena = a;
+}
+
+// Pyramid levels panorama_image searches for corners, see set_panorama_levels.
+static int panorama_levels = 1;
+
+// Have panorama_image build an image_pyramid of each input once and find
+// Harris corners over all of its levels with harris_pyramid_detector.
+// int levels: pyramid levels including the full size image. 1, the
+//             default, detects at full size with detect_corners and the
+//             detector picked by set_corner_detector.
+void set_panorama_levels(int levels)
+{
+    panorama_levels = MAX(levels, 1);
+}
+
 // Create a panoramam between two images.
 // image a, b: images to stitch together.
 // float sigma: gaussian for harris corner detector. Typical: 2
@@ -339,10 +407,21 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
     int an = 0;
     int bn = 0;
     int mn = 0;
+    arena *outer = use_arena(panorama_arena);
     
     // Calculate corners and descriptors
-    descriptor *ad = harris_corner_detector(a, sigma, thresh, nms, &an);
-    descriptor *bd = harris_corner_detector(b, sigma, thresh, nms, &bn);
+    descriptor *ad, *bd;
+    if(panorama_levels > 1){
+        image_pyramid pa = make_image_pyramid(a, panorama_levels);
+        image_pyramid pb = make_image_pyramid(b, panorama_levels);
+        ad = harris_pyramid_detector(&pa, sigma, thresh, nms, &an);
+        bd = harris_pyramid_detector(&pb, sigma, thresh, nms, &bn);
+        free_image_pyramid(pa);
+        free_image_pyramid(pb);
+    } else {
+        ad = detect_corners(a, sigma, thresh, nms, &an);
+        bd = detect_corners(b, sigma, thresh, nms, &bn);
+    }
 
     // Find matches
     match *m = match_descriptors(ad, an, bd, bn, &mn);
@@ -350,20 +429,30 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
     // Run RANSAC to find the homography
     matrix H = RANSAC(m, mn, inlier_thresh, iters, cutoff);
 
-    if(1){
+    // The debug image may be written after this returns, keep it on the heap
+    use_arena(0);
+    if(debug_output){
         // Mark corners and matches between images
         mark_corners(a, ad, an);
         mark_corners(b, bd, bn);
         image inlier_matches = draw_inliers(a, b, H, m, mn, inlier_thresh);
-        save_image(inlier_matches, "inliers");
+        if(debug_saver){
+            image_saver_submit(debug_saver, inlier_matches, "inliers", 0);
+        } else {
+            save_image(inlier_matches, "inliers");
+            free_image(inlier_matches);
+        }
     }
 
-    free_descriptors(ad, an);
-    free_descriptors(bd, bn);
-    free(m);
-
     // Stitch the images together with the homography
+    use_arena(outer);
     image comb = combine_images(a, b, H);
+
+    free_descriptors(ad, an);
+    free_descriptors(bd, bn);
+    arena_free(m);
+    free_matrix(H);
+    if(panorama_arena) arena_reset(panorama_arena);
     return comb;
 }
 
@@ -373,7 +462,10 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
 // returns: image projected onto cylinder, then flattened.
 image cylindrical_project(image im, float f)
 {
-    //TODO: project image onto a cylinder
-    image c = copy_image(im);
+    // For many frames from the same camera build the remap once with
+    // make_cylindrical_remap and call remap_image on each frame instead.
+    remap m = make_cylindrical_remap(im.w, im.h, f);
+    image c = remap_image(m, im);
+    free_remap(m);
     return c;
 }
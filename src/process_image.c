@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -14,7 +15,7 @@ float get_pixel(image im, int x, int y, int c)
     if(x>=im.w) x = im.w-1;
     if(y<0) y=0;
     if(y>=im.h) y = im.h-1;
-    return im.data[im.h*im.w*c + y*im.w + x];
+    return IMAGE_AT(im, x, y, c);
 }
 
 void set_pixel(image im, int x, int y, int c, float v)
@@ -23,16 +24,88 @@ void set_pixel(image im, int x, int y, int c, float v)
         printf("Invalid arguments!");
         return;
     }
-    im.data[im.h*im.w*c + y*im.w + x] = v;
+    IMAGE_AT(im, x, y, c) = v;
 }
 
 image copy_image(image im)
 {
     image copy = make_image(im.w, im.h, im.c);
-    memcpy(copy.data, im.data, im.h*im.w*im.c *sizeof(float));
+    if(IMAGE_PACKED(im)){
+        memcpy(copy.data, im.data, im.h*im.w*im.c *sizeof(float));
+        return copy;
+    }
+    copy_image_into(im, copy);
     return copy;
 }
 
+// Copy the pixels of one image into another of the same size, typically a
+// view of a larger image to paste into it.
+// image im: image to copy.
+// image out: im.w x im.h image with at least im.c channels.
+void copy_image_into(image im, image out)
+{
+    assert(out.w == im.w && out.h == im.h && out.c >= im.c);
+    for(int c=0;c<im.c;++c){
+        for(int y=0;y<im.h;++y){
+            memcpy(&IMAGE_AT(out,0,y,c), &IMAGE_AT(im,0,y,c), im.w*sizeof(float));
+        }
+    }
+}
+
+// A view of a rectangle of an image. It shares the image's pixels, so
+// nothing is copied and writes to the view land in the image. Views carry
+// the image's stride and plane and can be passed to any function taking an
+// image, to crop, to split work into tiles, or to paste into part of a
+// larger image with copy_image_into.
+// image im: image to look into, must outlive the view.
+// int x, y, w, h: rectangle to view, inside im.
+// returns: the view. It owns nothing, don't free it.
+image image_view(image im, int x, int y, int w, int h)
+{
+    assert(x >= 0 && y >= 0 && w >= 0 && h >= 0 && x + w <= im.w && y + h <= im.h);
+    image v = {0};
+    v.w = w;
+    v.h = h;
+    v.c = im.c;
+    v.data = &IMAGE_AT(im, x, y, 0);
+    v.stride = IMAGE_STRIDE(im);
+    v.plane = IMAGE_PLANE(im);
+    return v;
+}
+
+// Fill the border of a padded image with copies of its edge pixels.
+// Call it again after writing to the image if kernels will read the border.
+// image im: image from make_padded_image.
+void replicate_border(image im)
+{
+    int x, y, k;
+    for(k = 0; k < im.c; ++k){
+        for(y = 0; y < im.h; ++y){
+            float *row = &IMAGE_AT(im, 0, y, k);
+            for(x = 1; x <= im.pad; ++x){
+                row[-x] = row[0];
+                row[im.w-1+x] = row[im.w-1];
+            }
+        }
+        for(y = 1; y <= im.pad; ++y){
+            memcpy(&IMAGE_AT(im, -im.pad, -y, k), &IMAGE_AT(im, -im.pad, 0, k), (im.w + 2*im.pad)*sizeof(float));
+            memcpy(&IMAGE_AT(im, -im.pad, im.h-1+y, k), &IMAGE_AT(im, -im.pad, im.h-1, k), (im.w + 2*im.pad)*sizeof(float));
+        }
+    }
+}
+
+// Copy an image into a padded image with its border filled in, see
+// make_padded_image.
+// int pad: width of the border.
+// returns: the padded copy.
+image pad_image(image im, int pad)
+{
+    image p = make_padded_image(im.w, im.h, im.c, pad);
+    copy_image_into(im, p);
+    replicate_border(p);
+    return p;
+}
+
 image rgb_to_grayscale(image im)
 {
     assert(im.c == 3);
@@ -48,6 +121,24 @@ image rgb_to_grayscale(image im)
     return gray;
 }
 
+// rgb_to_grayscale for typed images, a row at a time.
+typed_image rgb_to_grayscale_typed(typed_image im)
+{
+    assert(im.c == 3);
+    typed_image gray = make_typed_image(im.w, im.h, 1, im.dtype);
+    float *rgb = malloc(3*im.w*sizeof(float));
+    float *r = rgb, *g = rgb + im.w, *b = rgb + 2*im.w;
+    for(int y=0;y<im.h;++y){
+        typed_get_row(im, y, 0, r);
+        typed_get_row(im, y, 1, g);
+        typed_get_row(im, y, 2, b);
+        for(int x=0;x<im.w;++x) r[x] = r[x]*0.299f + g[x]*0.587f + b[x]*0.114f;
+        typed_set_row(gray, y, 0, r);
+    }
+    free(rgb);
+    return gray;
+}
+
 void shift_image(image im, int c, float v)
 {
     for(int y=0;y<im.h;++y){
@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+
+// Blur with the 5-tap binomial kernel [1 4 6 4 1]/16 and drop every other
+// row and column, in one pass. Each output row filters the five source
+// rows it needs vertically into a single row buffer, then filters that
+// horizontally at the even columns only, so no full-size blurred image is
+// ever made.
+// image im: image to reduce.
+// image out: (im.w+1)/2 x (im.h+1)/2 image with as many channels as im.
+void pyramid_reduce_into(image im, image out)
+{
+    assert(out.w == (im.w+1)/2 && out.h == (im.h+1)/2 && out.c == im.c);
+    float *row = calloc(im.w, sizeof(float));
+    int x, y, k;
+    for(k = 0; k < im.c; ++k){
+        for(y = 0; y < out.h; ++y){
+            const float *r0 = &IMAGE_AT(im, 0, MAX(2*y-2, 0), k);
+            const float *r1 = &IMAGE_AT(im, 0, MAX(2*y-1, 0), k);
+            const float *r2 = &IMAGE_AT(im, 0, 2*y, k);
+            const float *r3 = &IMAGE_AT(im, 0, MIN(2*y+1, im.h-1), k);
+            const float *r4 = &IMAGE_AT(im, 0, MIN(2*y+2, im.h-1), k);
+            for(x = 0; x < im.w; ++x){
+                row[x] = r0[x] + 4*(r1[x] + r3[x]) + 6*r2[x] + r4[x];
+            }
+            float *d = &IMAGE_AT(out, 0, y, k);
+            for(x = 0; x < out.w; ++x){
+                int x0 = MAX(2*x-2, 0), x1 = MAX(2*x-1, 0);
+                int x3 = MIN(2*x+1, im.w-1), x4 = MIN(2*x+2, im.w-1);
+                d[x] = (row[x0] + 4*(row[x1] + row[x3]) + 6*row[2*x] + row[x4])*(1.f/256);
+            }
+        }
+    }
+    free(row);
+}
+
+// Halve an image, see pyramid_reduce_into.
+// returns: (w+1)/2 x (h+1)/2 image.
+image pyramid_reduce(image im)
+{
+    image out = make_image((im.w+1)/2, (im.h+1)/2, im.c);
+    pyramid_reduce_into(im, out);
+    return out;
+}
+
+// Expand an image to twice its size, the inverse of pyramid_reduce.
+// Source rows are expanded horizontally once into a three row ring.
+// image im: image to expand.
+// int w, h: size of the result, 2*im.w or 2*im.w-1 (same for h).
+// returns: w x h image.
+image pyramid_expand(image im, int w, int h)
+{
+    image out = make_image(w, h, im.c);
+    float *ring = calloc(3*w, sizeof(float));
+    int x, y, k, t;
+    for(k = 0; k < im.c; ++k){
+        int id[3] = {-1, -1, -1};
+        for(y = 0; y < h; ++y){
+            int i = y/2;
+            int rows[3] = {MAX(i-1, 0), i, MIN(i+1, im.h-1)};
+            float *r[3];
+            for(t = 0; t < 3; ++t){
+                int slot = rows[t]%3;
+                r[t] = ring + slot*w;
+                if(id[slot] == rows[t]) continue;
+                const float *a = &IMAGE_AT(im, 0, rows[t], k);
+                for(x = 0; x < w; ++x){
+                    int j = x/2;
+                    if(x & 1) r[t][x] = .5f*(a[j] + a[MIN(j+1, im.w-1)]);
+                    else r[t][x] = .125f*(a[MAX(j-1, 0)] + 6*a[j] + a[MIN(j+1, im.w-1)]);
+                }
+                id[slot] = rows[t];
+            }
+            float *d = out.data + k*w*h + y*w;
+            if(y & 1) for(x = 0; x < w; ++x) d[x] = .5f*(r[1][x] + r[2][x]);
+            else for(x = 0; x < w; ++x) d[x] = .125f*(r[0][x] + 6*r[1][x] + r[2][x]);
+        }
+    }
+    free(ring);
+    return out;
+}
+
+// Make a Gaussian pyramid over an image. Level 0 is the image itself (not
+// copied), every other level lives in one allocation and is only computed
+// the first time pyramid_level asks for it.
+// image im: base of the pyramid, must outlive the pyramid.
+// int levels: number of levels wanted including the base. Stops early
+//             once a level would be smaller than 2x2.
+// returns: the pyramid.
+image_pyramid make_image_pyramid(image im, int levels)
+{
+    image_pyramid p = {0};
+    levels = MIN(levels, PYRAMID_MAX_LEVELS);
+    p.level[0] = im;
+    p.levels = 1;
+    p.built = 1;
+    size_t size = 0;
+    int w = im.w, h = im.h;
+    while(p.levels < levels && w > 2 && h > 2){
+        w = (w+1)/2;
+        h = (h+1)/2;
+        p.level[p.levels].w = w;
+        p.level[p.levels].h = h;
+        p.level[p.levels].c = im.c;
+        size += (size_t)w*h*im.c;
+        ++p.levels;
+    }
+    if(size) p.arena = calloc(size, sizeof(float));
+    float *data = p.arena;
+    int i;
+    for(i = 1; i < p.levels; ++i){
+        p.level[i].data = data;
+        data += (size_t)p.level[i].w*p.level[i].h*im.c;
+    }
+    return p;
+}
+
+// Get a level of a pyramid, building it and the ones below it if needed.
+// image_pyramid *p: the pyramid.
+// int i: level, 0 is the base.
+// returns: the level. Owned by the pyramid, do not free it.
+image pyramid_level(image_pyramid *p, int i)
+{
+    assert(i >= 0 && i < p->levels);
+    for(; p->built <= i; ++p->built){
+        pyramid_reduce_into(p->level[p->built-1], p->level[p->built]);
+    }
+    return p->level[i];
+}
+
+void free_image_pyramid(image_pyramid p)
+{
+    free(p.arena);
+}
@@ -0,0 +1,220 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+
+// Files start with this header, padded out to RAW_HEADER bytes so the
+// planar pixels that follow are page aligned and can be mapped in place.
+#define RAW_MAGIC "UWIM"
+#define RAW_VERSION 1
+#define RAW_HEADER 4096
+typedef struct{
+    char magic[4];
+    int version;
+    int w, h, c;
+    int dtype;
+} raw_header;
+
+// Samples converted per chunk when writing or reading u8 and f16 files.
+#define RAW_CHUNK 16384
+
+static size_t raw_dtype_size(int dtype)
+{
+    if(dtype == RAW_U8) return 1;
+    if(dtype == RAW_F16) return 2;
+    return 4;
+}
+
+// IEEE 754 half precision to single precision, including subnormals,
+// infinities and NaN.
+float half_to_float(unsigned short h)
+{
+    unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+    unsigned int exp = (h >> 10) & 0x1f;
+    unsigned int man = h & 0x3ff;
+    unsigned int bits;
+    if(exp == 0x1f){
+        bits = sign | 0x7f800000 | (man << 13);
+    } else if(exp){
+        bits = sign | ((exp + 112) << 23) | (man << 13);
+    } else if(man){
+        // Subnormal half, normalize it
+        exp = 113;
+        while(!(man & 0x400)){
+            man <<= 1;
+            --exp;
+        }
+        bits = sign | (exp << 23) | ((man & 0x3ff) << 13);
+    } else {
+        bits = sign;
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Single precision to IEEE 754 half precision, rounding to nearest even.
+// Values too large for a half become infinity.
+unsigned short float_to_half(float f)
+{
+    unsigned int bits;
+    memcpy(&bits, &f, sizeof(bits));
+    unsigned int sign = (bits >> 16) & 0x8000;
+    unsigned int exp = (bits >> 23) & 0xff;
+    unsigned int man = bits & 0x7fffff;
+    if(exp == 0xff) return sign | 0x7c00 | (man ? 0x200 : 0);
+    int e = (int)exp - 112;
+    if(e >= 0x1f) return sign | 0x7c00;
+    if(e <= 0){
+        // Subnormal half or zero
+        if(e < -10) return sign;
+        man |= 0x800000;
+        int shift = 14 - e;
+        unsigned int half = man >> shift;
+        unsigned int rest = man & ((1u << shift) - 1);
+        unsigned int mid = 1u << (shift - 1);
+        if(rest > mid || (rest == mid && (half & 1))) ++half;
+        return sign | half;
+    }
+    unsigned int half = (e << 10) | (man >> 13);
+    unsigned int rest = man & 0x1fff;
+    if(rest > 0x1000 || (rest == 0x1000 && (half & 1))) ++half;
+    return sign | half;
+}
+
+// Save an image in the native raw format, "<name>.raw".
+// The payload is the planar pixels exactly as they are in memory (or
+// converted to dtype), starting one page into the file.
+// image im: image to save.
+// const char *name: file name without extension.
+// int dtype: RAW_F32 for an exact copy, RAW_U8 to clamp to [0, 1] and
+//            quantize to 8 bits, RAW_F16 for half precision.
+// returns: 1 on success, 0 if the file could not be written.
+int save_image_raw(image im, const char *name, int dtype)
+{
+    char *buff = malloc(strlen(name) + 5);
+    sprintf(buff, "%s.raw", name);
+    FILE *fp = fopen(buff, "wb");
+    if(!fp){
+        fprintf(stderr, "Failed to write image %s\n", buff);
+        free(buff);
+        return 0;
+    }
+    raw_header hd = {{0}};
+    memcpy(hd.magic, RAW_MAGIC, 4);
+    hd.version = RAW_VERSION;
+    hd.w = im.w;
+    hd.h = im.h;
+    hd.c = im.c;
+    hd.dtype = dtype;
+    char page[RAW_HEADER] = {0};
+    memcpy(page, &hd, sizeof(hd));
+    size_t n = (size_t)im.w*im.h*im.c;
+    int ok = fwrite(page, 1, RAW_HEADER, fp) == RAW_HEADER;
+    // The file holds packed planes, views and padded images are copied
+    image view = im;
+    if(!IMAGE_PACKED(im)) im = copy_image(im);
+    if(dtype == RAW_F32){
+        ok = ok && fwrite(im.data, sizeof(float), n, fp) == n;
+    } else {
+        unsigned char *chunk = malloc(RAW_CHUNK*raw_dtype_size(dtype));
+        unsigned char *u8 = chunk;
+        unsigned short *f16 = (unsigned short *)chunk;
+        size_t i, j;
+        for(i = 0; ok && i < n; i += RAW_CHUNK){
+            size_t m = MIN(n - i, RAW_CHUNK);
+            const float *s = im.data + i;
+            if(dtype == RAW_U8){
+                for(j = 0; j < m; ++j) u8[j] = (unsigned char)(MIN(MAX(s[j], 0.f), 1.f)*255 + .5f);
+            } else {
+                for(j = 0; j < m; ++j) f16[j] = float_to_half(s[j]);
+            }
+            ok = fwrite(chunk, raw_dtype_size(dtype), m, fp) == m;
+        }
+        free(chunk);
+    }
+    if(im.data != view.data) free_image(im);
+    ok = fclose(fp) == 0 && ok;
+    if(!ok) fprintf(stderr, "Failed to write image %s\n", buff);
+    free(buff);
+    return ok;
+}
+
+// Load an image saved by save_image_raw.
+// Float files are mapped copy-on-write, so the image points straight into
+// the page cache: nothing is read until a pixel is touched, and writes
+// to the image never reach the file. Other dtypes are converted into an
+// anonymous mapping of the same layout.
+// const char *filename: file to load, with its extension.
+// returns: the image, free it with free_image_raw. Has data == 0 if the
+//          file could not be loaded.
+image load_image_raw(const char *filename)
+{
+    image im = {0};
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0){
+        fprintf(stderr, "Cannot load image \"%s\"\n", filename);
+        return im;
+    }
+    raw_header hd;
+    struct stat st;
+    if(read(fd, &hd, sizeof(hd)) != sizeof(hd) || memcmp(hd.magic, RAW_MAGIC, 4) ||
+            hd.version != RAW_VERSION || hd.dtype < RAW_F32 || hd.dtype > RAW_F16 ||
+            fstat(fd, &st) || hd.w < 0 || hd.h < 0 || hd.c < 0){
+        fprintf(stderr, "Cannot load image \"%s\": not a raw image\n", filename);
+        close(fd);
+        return im;
+    }
+    size_t n = (size_t)hd.w*hd.h*hd.c;
+    if((size_t)st.st_size < RAW_HEADER + n*raw_dtype_size(hd.dtype)){
+        fprintf(stderr, "Cannot load image \"%s\": file is truncated\n", filename);
+        close(fd);
+        return im;
+    }
+    size_t bytes = RAW_HEADER + n*sizeof(float);
+    void *map;
+    if(hd.dtype == RAW_F32){
+        map = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    } else {
+        map = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(map != MAP_FAILED){
+            const unsigned char *src = mmap(0, RAW_HEADER + n*raw_dtype_size(hd.dtype),
+                    PROT_READ, MAP_PRIVATE, fd, 0);
+            if(src == MAP_FAILED){
+                munmap(map, bytes);
+                map = MAP_FAILED;
+            } else {
+                float *d = (float *)((char *)map + RAW_HEADER);
+                const unsigned char *u8 = src + RAW_HEADER;
+                const unsigned short *f16 = (const unsigned short *)(src + RAW_HEADER);
+                size_t i;
+                if(hd.dtype == RAW_U8) for(i = 0; i < n; ++i) d[i] = u8[i]*(1.f/255);
+                else for(i = 0; i < n; ++i) d[i] = half_to_float(f16[i]);
+                munmap((void *)src, RAW_HEADER + n*raw_dtype_size(hd.dtype));
+            }
+        }
+    }
+    close(fd);
+    if(map == MAP_FAILED){
+        fprintf(stderr, "Cannot map image \"%s\"\n", filename);
+        return im;
+    }
+    im.w = hd.w;
+    im.h = hd.h;
+    im.c = hd.c;
+    im.data = (float *)((char *)map + RAW_HEADER);
+    return im;
+}
+
+// Unmap an image returned by load_image_raw.
+void free_image_raw(image im)
+{
+    if(!im.data) return;
+    munmap((char *)im.data - RAW_HEADER, RAW_HEADER + (size_t)im.w*im.h*im.c*sizeof(float));
+}
@@ -2,6 +2,7 @@
 #include <math.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
 #include "matrix.h"
 #include "image.h"
 #include "test.h"
@@ -35,9 +36,10 @@ int same_image(image a, image b){
         return 0;
     }
     for(i = 0; i < a.w*a.h*a.c; ++i){
-        if(!within_eps(a.data[i], b.data[i])) 
+        int x = i%a.w, y = i/a.w%a.h, k = i/(a.w*a.h);
+        if(!within_eps(IMAGE_AT(a, x, y, k), IMAGE_AT(b, x, y, k))) 
         {
-            printf("The value should be %f, but it is %f! \n", b.data[i], a.data[i]);
+            printf("The value should be %f, but it is %f! \n", IMAGE_AT(b, x, y, k), IMAGE_AT(a, x, y, k));
             return 0;
         }
     }
@@ -188,6 +190,70 @@ void test_multiple_resize()
 }
 
 
+void test_filtered_resize()
+{
+    image im = load_image("data/dog.jpg");
+    int w = im.w/4, h = im.h/4;
+
+    // Shrinking with the box filter averages whole blocks
+    image area = filtered_resize(im, w, h, RESIZE_BOX);
+    TEST(area.w == w && area.h == h);
+    int x, y, c = 1;
+    float sum = 0;
+    for(y = 40; y < 44; ++y) for(x = 80; x < 84; ++x) sum += get_pixel(im, x, y, c);
+    TEST(within_eps(get_pixel(area, 20, 10, c), sum/16));
+
+    // Filters preserve flat regions and keep the image where it was
+    image flat = make_image(37, 23, 1);
+    shift_image(flat, 0, .5);
+    int f;
+    for(f = RESIZE_BOX; f <= RESIZE_LANCZOS3; ++f){
+        image small = filtered_resize(flat, 9, 5, f);
+        image big = filtered_resize(flat, 80, 50, f);
+        TEST(within_eps(get_pixel(small, 4, 2, 0), .5) && within_eps(get_pixel(small, 0, 4, 0), .5));
+        TEST(within_eps(get_pixel(big, 79, 0, 0), .5) && within_eps(get_pixel(big, 40, 25, 0), .5));
+        image down = filtered_resize(im, w, h, f);
+        TEST(fabsf(get_pixel(down, 20, 10, c) - get_pixel(area, 20, 10, c)) < .1);
+        free_image(small); free_image(big); free_image(down);
+    }
+    image same = filtered_resize(im, im.w, im.h, RESIZE_TRIANGLE);
+    TEST(same_image(same, im));
+
+    free_image(im); free_image(area); free_image(flat); free_image(same);
+}
+
+void test_u8_resize()
+{
+    image im = load_image("data/dog.jpg");
+    unsigned char *src = calloc(im.w*im.h*im.c, sizeof(char));
+    int i, k;
+    for(k = 0; k < im.c; ++k){
+        for(i = 0; i < im.w*im.h; ++i){
+            src[i*im.c + k] = roundf(255*im.data[k*im.w*im.h + i]);
+        }
+    }
+    int sizes[4][2] = {{713, 467}, {im.w*3, im.h*2}, {im.w/5, im.h/7}, {1, 1}};
+    int s;
+    for(s = 0; s < 4; ++s){
+        int w = sizes[s][0], h = sizes[s][1];
+        image gt = bilinear_resize(im, w, h);
+        unsigned char *dst = calloc(w*h*im.c, sizeof(char));
+        bilinear_resize_u8(src, im.w, im.h, im.c, dst, w, h);
+        int maxerr = 0;
+        for(k = 0; k < im.c; ++k){
+            for(i = 0; i < w*h; ++i){
+                int err = abs(dst[i*im.c + k] - (int)roundf(255*gt.data[k*w*h + i]));
+                maxerr = MAX(maxerr, err);
+            }
+        }
+        TEST(maxerr <= 1);
+        free(dst);
+        free_image(gt);
+    }
+    free(src);
+    free_image(im);
+}
+
 void test_highpass_filter(){
     image im = load_image("data/dog.jpg");
     image f = make_highpass_filter();
@@ -384,9 +450,960 @@ void test_cornerness()
     free_image(gt);
 }
 
+void test_least_squares()
+{
+    int i, j;
+    double x[4] = {1.5, -2, .25, 3};
+    matrix M = make_matrix(20, 4);
+    matrix b = make_matrix(20, 1);
+    for(i = 0; i < M.rows; ++i){
+        for(j = 0; j < M.cols; ++j){
+            M.data[i][j] = (i*7 + j*13)%11 - 5 + .1*j;
+            b.data[i][0] += M.data[i][j]*x[j];
+        }
+    }
+    matrix a = solve_system(M, b);
+    TEST(a.rows == 4 && a.cols == 1);
+    for(j = 0; j < 4; ++j) TEST(within_eps(a.data[j][0], x[j]));
+
+    matrix q = qr_solve_in_place(M, b);
+    TEST(q.rows == 4 && q.cols == 1);
+    for(j = 0; j < 4; ++j) TEST(within_eps(q.data[j][0], x[j]));
+
+    // Rank deficient systems report failure instead of garbage
+    matrix D = make_matrix(6, 2);
+    matrix db = make_matrix(6, 1);
+    for(i = 0; i < D.rows; ++i){
+        D.data[i][0] = i;
+        D.data[i][1] = 2*i;
+        db.data[i][0] = i;
+    }
+    matrix none = solve_system(D, db);
+    TEST(none.data == 0);
+
+    free_matrix(M); free_matrix(b); free_matrix(a); free_matrix(q);
+    free_matrix(D); free_matrix(db);
+}
+
+void test_combine_images()
+{
+    image a = load_image("data/dogsmall.jpg");
+    image b = load_image("data/dog.jpg");
+    matrix H = make_identity_homography();
+    H.data[0][0] = 1.1; H.data[0][1] = .05; H.data[0][2] = 20;
+    H.data[1][0] = -.03; H.data[1][1] = .95; H.data[1][2] = 10;
+    H.data[2][0] = .0002; H.data[2][1] = -.0001;
+    matrix Hinv = matrix_invert(H);
+    image c = combine_images(a, b, H);
+    float tlx = 0, tly = 0;
+    int i, j, k;
+    for(i = 0; i < 4; ++i){
+        point p = project_point(Hinv, make_point(i%2 ? b.w-1 : 0, i/2 ? b.h-1 : 0));
+        tlx = MIN(tlx, p.x);
+        tly = MIN(tly, p.y);
+    }
+    int dx = tlx;
+    int dy = tly;
+
+    // Compare against projecting and sampling one pixel at a time
+    image gt = copy_image(c);
+    for(j = 0; j < gt.h; ++j){
+        for(i = 0; i < gt.w; ++i){
+            point p = project_point(H, make_point(i+dx, j+dy));
+            // Points right on the border of b may round either way
+            if(p.x < .01 || p.x > b.w-.01 || p.y < .01 || p.y > b.h-.01) continue;
+            for(k = 0; k < gt.c; ++k){
+                set_pixel(gt, i, j, k, bilinear_interpolate(b, p.x, p.y, k));
+            }
+        }
+    }
+    TEST(same_image(c, gt));
+    free_image(a); free_image(b); free_image(c); free_image(gt);
+    free_matrix(H); free_matrix(Hinv);
+}
+
+void test_canvas()
+{
+    image a = load_image("data/dogsmall.jpg");
+    image b = load_image("data/dog.jpg");
+    matrix H = make_translation_homography(-200, 30);
+    H.data[0][1] = .1;
+    H.data[2][0] = .0001;
+    image gt = combine_images(a, b, H);
+
+    canvas cv = combine_images_canvas(a, b, H, 0);
+    image c = canvas_to_image(cv);
+    TEST(same_image(c, gt));
+    free_image(c);
+    free_canvas(cv);
+
+    canvas mapped = combine_images_canvas(a, b, H, "canvas.scratch");
+    TEST(mapped.map != 0);
+    image m = canvas_to_image(mapped);
+    TEST(same_image(m, gt));
+    free_image(m);
+    free_canvas(mapped);
+
+    // Tiles nobody writes to are never allocated
+    canvas sparse = make_canvas(4*CANVAS_TILE, 3*CANVAS_TILE, 3, 0);
+    canvas_paste(sparse, a, 3*CANVAS_TILE + 10, 2*CANVAS_TILE + 10);
+    TEST(sparse.tiles[0] == 0);
+    TEST(sparse.tiles[sparse.tw*sparse.th-1] != 0);
+    TEST(within_eps(sparse.tiles[sparse.tw*sparse.th-1][10*CANVAS_TILE+10], get_pixel(a, 0, 0, 0)));
+    free_canvas(sparse);
+
+    free_image(a); free_image(b); free_image(gt);
+    free_matrix(H);
+}
+
+void test_cylindrical()
+{
+    image im = load_image("data/dog.jpg");
+    float f = 400;
+    image c = cylindrical_project(im, f);
+    image gt = make_image(im.w, im.h, im.c);
+    int x, y, k;
+    for(y = 0; y < im.h; ++y){
+        for(x = 0; x < im.w; ++x){
+            float theta = (x - im.w/2)/f;
+            float u = f*tanf(theta) + im.w/2;
+            float v = f*(y - im.h/2)/f/cosf(theta) + im.h/2;
+            if(u < 0 || u > im.w-1 || v < 0 || v > im.h-1) continue;
+            for(k = 0; k < im.c; ++k){
+                set_pixel(gt, x, y, k, bilinear_interpolate(im, u, v, k));
+            }
+        }
+    }
+    TEST(same_image(c, gt));
+
+    // Same map reused for another frame
+    remap m = make_cylindrical_remap(im.w, im.h, f);
+    image again = remap_image(m, im);
+    TEST(same_image(again, c));
+    free_remap(m);
+
+    free_image(im); free_image(c); free_image(gt); free_image(again);
+}
+
+image crop_columns(image im, int x0, int x1)
+{
+    image c = make_image(x1 - x0, im.h, im.c);
+    int x, y, k;
+    for(k = 0; k < im.c; ++k){
+        for(y = 0; y < im.h; ++y){
+            for(x = x0; x < x1; ++x){
+                set_pixel(c, x - x0, y, k, get_pixel(im, x, y, k));
+            }
+        }
+    }
+    return c;
+}
+
+void test_blend()
+{
+    image im = load_image("data/dog.jpg");
+    image a = crop_columns(im, 0, 400);
+    image b = crop_columns(im, 200, im.w);
+    matrix H = make_translation_homography(-200, 0);
+
+    // Blending two views of the same scene gives back the scene.
+    // The stitched width stops at the last column of b, not one past it.
+    image gt = crop_columns(im, 0, im.w-1);
+    image feather = combine_images_blend(a, b, H, BLEND_FEATHER);
+    TEST(same_image(feather, gt));
+    image multi = combine_images_blend(a, b, H, BLEND_MULTIBAND);
+    TEST(same_image(multi, gt));
+
+    // A brighter b fades in across the overlap instead of cutting in
+    shift_image(b, 0, .2);
+    image f2 = combine_images_blend(a, b, H, BLEND_FEATHER);
+    image m2 = combine_images_blend(a, b, H, BLEND_MULTIBAND);
+    float d1 = get_pixel(f2, 250, 100, 0) - get_pixel(im, 250, 100, 0);
+    float d2 = get_pixel(f2, 350, 100, 0) - get_pixel(im, 350, 100, 0);
+    TEST(d1 > .01 && d1 < d2 && d2 < .19);
+    TEST(within_eps(get_pixel(m2, 100, 100, 0), get_pixel(im, 100, 100, 0)));
+    TEST(within_eps(get_pixel(m2, 500, 100, 0), get_pixel(im, 500, 100, 0) + .2));
+
+    free_image(im); free_image(a); free_image(b); free_image(gt);
+    free_image(feather); free_image(multi); free_image(f2); free_image(m2);
+    free_matrix(H);
+}
+
+void test_pyramid()
+{
+    image im = load_image("data/dog.jpg");
+    image_pyramid p = make_image_pyramid(im, 4);
+    TEST(p.levels == 4 && p.built == 1);
+    image l2 = pyramid_level(&p, 2);
+    TEST(p.built == 3);
+    TEST(l2.w == ((im.w+1)/2+1)/2 && l2.h == ((im.h+1)/2+1)/2 && l2.c == im.c);
+
+    image r1 = pyramid_reduce(im);
+    image r2 = pyramid_reduce(r1);
+    TEST(same_image(l2, r2));
+
+    // Reducing then expanding keeps the low frequencies
+    image up = pyramid_expand(r1, im.w, im.h);
+    image blur = smooth_image(im, 1);
+    TEST(fabsf(get_pixel(up, 200, 200, 0) - get_pixel(blur, 200, 200, 0)) < .05);
+
+    image flat = make_image(50, 31, 1);
+    shift_image(flat, 0, .25);
+    image_pyramid pf = make_image_pyramid(flat, 10);
+    TEST(pf.levels == 5);
+    image top = pyramid_level(&pf, pf.levels-1);
+    TEST(within_eps(get_pixel(top, 0, 0, 0), .25) && within_eps(get_pixel(top, top.w-1, top.h-1, 0), .25));
+
+    free_image_pyramid(p);
+    free_image_pyramid(pf);
+    free_image(im); free_image(r1); free_image(r2); free_image(up); free_image(blur); free_image(flat);
+}
+
+void test_harris_response()
+{
+    image im = load_image("data/dogbw.png");
+    image s = structure_matrix(im, 2);
+    image gt = cornerness_response(s);
+    image r = harris_response(im, 2);
+    feature_normalize2(gt);
+    feature_normalize2(r);
+    TEST(same_image(r, gt));
+    free_image(im); free_image(s); free_image(gt); free_image(r);
+}
+
+void test_multiscale_harris()
+{
+    image im = load_image("data/Rainier1.png");
+    int n = 0, i;
+    descriptor *d = harris_corner_detector_multiscale(im, 2, .3, 3, 3, &n);
+    TEST(n > 0);
+    int bad = 0, coarse = 0;
+    for(i = 0; i < n; ++i){
+        bad += d[i].p.x < 0 || d[i].p.x >= im.w || d[i].p.y < 0 || d[i].p.y >= im.h;
+        bad += d[i].scale != 1 && d[i].scale != 2 && d[i].scale != 4;
+        coarse += d[i].scale > 1;
+    }
+    TEST(bad == 0);
+    TEST(coarse > 0);
+
+    // A single level is plain single scale detection with NMS
+    int n1 = 0;
+    descriptor *d1 = harris_corner_detector_multiscale(im, 2, .3, 3, 1, &n1);
+    TEST(n1 > 0);
+    for(i = 0; i < n1; ++i) bad += d1[i].scale != 1;
+    TEST(bad == 0);
+
+    // panorama_image can detect over a pyramid of each input
+    image b = load_image("data/Rainier2.png");
+    set_debug_output(0, 0);
+    set_panorama_levels(3);
+    image pan = panorama_image(im, b, 2, .3, 3, 2, 1000, 30);
+    set_panorama_levels(1);
+    set_debug_output(1, 0);
+    TEST(pan.w > im.w && pan.h >= im.h);
+
+    free_descriptors(d, n);
+    free_descriptors(d1, n1);
+    free_image(pan);
+    free_image(b);
+    free_image(im);
+}
+
+void test_fast_corners()
+{
+    // Bright square on black, the only corners are its 4 corners
+    image im = make_image(64, 64, 1);
+    int x, y, i, k;
+    for(y = 20; y < 40; ++y) for(x = 20; x < 40; ++x) set_pixel(im, x, y, 0, 1);
+    float cx[4] = {20, 39, 20, 39}, cy[4] = {20, 20, 39, 39};
+    int n = 0;
+    descriptor *d = fast_corner_detector(im, .1, 9, 3, 2, &n);
+    int bad = 0, hit[4] = {0};
+    for(i = 0; i < n; ++i){
+        int near = 0;
+        for(k = 0; k < 4; ++k){
+            if(fabsf(d[i].p.x - cx[k]) <= 2 && fabsf(d[i].p.y - cy[k]) <= 2) near = hit[k] = 1;
+        }
+        bad += !near;
+    }
+    TEST(bad == 0);
+    TEST(hit[0] && hit[1] && hit[2] && hit[3]);
+    free_descriptors(d, n);
+
+    // A right angle leaves an arc of 11, too short for FAST-12, a dot doesn't
+    d = fast_corner_detector(im, .1, 12, 3, 0, &n);
+    TEST(n == 0);
+    free_descriptors(d, n);
+    set_pixel(im, 50, 50, 0, 1);
+    d = fast_corner_detector(im, .1, 12, 3, 0, &n);
+    TEST(n == 1 && d[0].p.x == 50 && d[0].p.y == 50);
+    free_descriptors(d, n);
+    set_pixel(im, 50, 50, 0, 0);
+
+    // Selected through set_corner_detector
+    int n0 = 0, n1 = 0;
+    descriptor *d0 = fast_corner_detector(im, .1, 9, 3, 2, &n0);
+    set_corner_detector(DETECTOR_FAST9, .1);
+    descriptor *d1 = detect_corners(im, 2, 1000, 3, &n1);
+    set_corner_detector(DETECTOR_HARRIS, .1);
+    TEST(n0 == n1);
+    free_descriptors(d0, n0);
+    free_descriptors(d1, n1);
+    free_image(im);
+
+    // Finds structure in a real image too
+    image r = load_image("data/Rainier1.png");
+    int nr = 0;
+    descriptor *dr = fast_corner_detector(r, .1, 9, 3, 2, &nr);
+    TEST(nr > 0);
+    free_descriptors(dr, nr);
+    free_image(r);
+}
+
+// Render a square with exact area coverage at each pixel.
+static image render_square(int size, float x0, float y0, float side)
+{
+    image im = make_image(size, size, 1);
+    int x, y;
+    for(y = 0; y < size; ++y){
+        float oy = MIN(y+1, y0+side) - MAX(y, y0);
+        for(x = 0; x < size; ++x){
+            float ox = MIN(x+1, x0+side) - MAX(x, x0);
+            im.data[y*size + x] = MAX(ox, 0)*MAX(oy, 0);
+        }
+    }
+    return im;
+}
+
+void test_subpixel_corners()
+{
+    // Shift a square by fractions of a pixel and see how well the shift
+    // is recovered from the corners, with and without refinement.
+    image base = render_square(64, 20, 20, 24);
+    int nb = 0, i, j, s;
+    descriptor *db = harris_corner_detector(base, 2, .01, 3, &nb);
+    TEST(nb == 4);
+    float err = 0, err_int = 0;
+    int count = 0;
+    for(s = 0; s < 16; ++s){
+        float tx = (s%4)*.25f + .1f, ty = (s/4)*.25f + .1f;
+        image im = render_square(64, 20 + tx, 20 + ty, 24);
+        int n = 0;
+        descriptor *d = harris_corner_detector(im, 2, .01, 3, &n);
+        for(i = 0; i < n; ++i){
+            for(j = 0; j < nb; ++j){
+                float ex = d[i].p.x - db[j].p.x - tx, ey = d[i].p.y - db[j].p.y - ty;
+                if(fabsf(ex) > 2 || fabsf(ey) > 2) continue;
+                err += sqrtf(ex*ex + ey*ey);
+                ex = roundf(d[i].p.x) - roundf(db[j].p.x) - tx;
+                ey = roundf(d[i].p.y) - roundf(db[j].p.y) - ty;
+                err_int += sqrtf(ex*ex + ey*ey);
+                ++count;
+            }
+        }
+        free_descriptors(d, n);
+        free_image(im);
+    }
+    TEST(count == 4*16);
+    err /= count;
+    err_int /= count;
+    printf("subpixel corners: mean error %f px refined, %f px integer\n", err, err_int);
+    TEST(err < .1);
+    TEST(err < err_int/2);
+    free_descriptors(db, nb);
+    free_image(base);
+}
+
+void test_load_channels()
+{
+    image im = load_image("data/dog.jpg");
+    image rgba = load_image_stb("data/dog.jpg", 4);
+    TEST(rgba.c == 3);
+    TEST(same_image(im, rgba));
+    image gray = load_image_stb("data/dog.jpg", 1);
+    TEST(gray.c == 1 && gray.w == im.w && gray.h == im.h);
+    // stb takes luma straight from the jpeg, close to ours on average
+    image g = rgb_to_grayscale(im);
+    int i;
+    float diff = 0;
+    for(i = 0; i < g.w*g.h; ++i) diff += fabsf(g.data[i] - gray.data[i]);
+    TEST(diff/(g.w*g.h) < .01);
+    free_image(im); free_image(rgba); free_image(gray); free_image(g);
+}
+
+void test_image_writer()
+{
+    image im = load_image("data/dogsmall.jpg");
+    image_writer w = make_image_writer();
+    TEST(write_image(&w, im, "writer_test", 0));
+    char *name = w.name;
+    TEST(write_image(&w, im, "writer_test", 0));
+    TEST(w.name == name);
+    remove("writer_test.jpg");
+    TEST(write_image(&w, im, "writer_test", 1));
+    image back = load_image("writer_test.png");
+    TEST(same_image(im, back));
+    free_image(back);
+
+    // Out of range values are clamped instead of wrapping around
+    image e = make_image(4, 1, 1);
+    e.data[0] = -.5; e.data[1] = .5; e.data[2] = 1; e.data[3] = 1.5;
+    TEST(write_image(&w, e, "writer_test", 1));
+    back = load_image("writer_test.png");
+    TEST(within_eps(back.data[0], 0) && within_eps(back.data[1], 128/255.));
+    TEST(within_eps(back.data[2], 1) && within_eps(back.data[3], 1));
+    remove("writer_test.png");
+    free_image_writer(&w);
+    free_image(back);
+    free_image(e);
+    free_image(im);
+}
+
+void test_load_scaled()
+{
+    image im = load_image("data/dog.jpg");
+    image half = load_image_scaled("data/dog.jpg", 2);
+    image eighth = load_image_scaled("data/dog.jpg", 8);
+    TEST(half.w == 384 && half.h == 288 && half.c == 3);
+    TEST(eighth.w == 96 && eighth.h == 72 && eighth.c == 3);
+    image gt = filtered_resize(im, 96, 72, RESIZE_BOX);
+    TEST(same_image(eighth, gt));
+    // Sizes that don't divide average the partial blocks at the edges
+    image odd = load_image_scaled("data/dogsmall.jpg", 8);
+    image small = load_image("data/dogsmall.jpg");
+    TEST(odd.w == (small.w+7)/8 && odd.h == (small.h+7)/8);
+    // Missing files come back empty instead of exiting
+    TEST(!load_image_scaled("data/missing.jpg", 4).data);
+    TEST(!load_image_scaled("data/missing.jpg", 1).data);
+    free_image(im); free_image(half); free_image(eighth);
+    free_image(gt); free_image(odd); free_image(small);
+}
+
+void test_image_loader()
+{
+    char *files[] = {"data/field1.jpg", "data/field2.jpg", "data/missing.jpg",
+        "data/field3.jpg", "data/dogsmall.jpg"};
+    int n = sizeof(files)/sizeof(files[0]);
+    image_loader *l = make_image_loader(files, n, 3, 2);
+    image im;
+    int i = 0, ok, failed = 0, same = 0;
+    while((ok = image_loader_next(l, &im)) >= 0){
+        if(ok){
+            image gt = load_image(files[i]);
+            same += same_image(im, gt);
+            free_image(gt);
+        } else {
+            failed += i == 2 && im.data == 0;
+        }
+        free_image(im);
+        ++i;
+    }
+    TEST(i == n);
+    TEST(same == n-1);
+    TEST(failed == 1);
+    free_image_loader(l);
+
+    // Stopping early frees what is still queued
+    l = make_image_loader(files, n, 2, 4);
+    TEST(image_loader_next(l, &im) == 1);
+    free_image(im);
+    free_image_loader(l);
+
+    image ims[5];
+    TEST(load_images(files, n, 2, ims) == 1);
+    TEST(ims[4].w == 192 && ims[2].data == 0);
+    for(i = 0; i < n; ++i) free_image(ims[i]);
+}
+
+void test_raw_image()
+{
+    image im = load_image("data/dog.jpg");
+    image r = harris_response(im, 2);
+    TEST(save_image_raw(r, "raw_test", RAW_F32));
+    image back = load_image_raw("raw_test.raw");
+    TEST(back.w == r.w && back.h == r.h && back.c == 1);
+    TEST(memcmp(back.data, r.data, r.w*r.h*sizeof(float)) == 0);
+    TEST(((size_t)back.data & 4095) == 0);
+    // Writing to the mapped image leaves the file alone
+    back.data[0] = 42;
+    free_image_raw(back);
+    back = load_image_raw("raw_test.raw");
+    TEST(back.data[0] == r.data[0]);
+    free_image_raw(back);
+
+    TEST(save_image_raw(im, "raw_test", RAW_U8));
+    back = load_image_raw("raw_test.raw");
+    TEST(same_image(im, back));
+    free_image_raw(back);
+
+    TEST(save_image_raw(im, "raw_test", RAW_F16));
+    back = load_image_raw("raw_test.raw");
+    TEST(same_image(im, back));
+    free_image_raw(back);
+    remove("raw_test.raw");
+
+    TEST(half_to_float(float_to_half(1)) == 1);
+    TEST(half_to_float(float_to_half(-2.5)) == -2.5);
+    TEST(half_to_float(float_to_half(65504)) == 65504);
+    TEST(float_to_half(1e6) == 0x7c00);
+    TEST(half_to_float(float_to_half(5.9604645e-8)) == 5.9604645e-8f);
+    TEST(within_eps(half_to_float(float_to_half(.1234)), .1234));
+
+    back = load_image_raw("data/dog.jpg");
+    TEST(back.data == 0);
+    free_image(r);
+    free_image(im);
+}
+
+void test_feature_cache()
+{
+    image im = load_image("data/Rainier1.png");
+    feature_cache fc = make_feature_cache("feature_cache_test");
+    clear_feature_cache(&fc);
+    int n0 = 0, n1 = 0, n2 = 0, i, same = 1;
+    descriptor *d0 = harris_corner_detector(im, 2, .3, 3, &n0);
+    descriptor *d1 = feature_cache_detect(&fc, im, DETECTOR_HARRIS, 0, 2, .3, 3, &n1);
+    descriptor *d2 = feature_cache_detect(&fc, im, DETECTOR_HARRIS, 0, 2, .3, 3, &n2);
+    TEST(fc.misses == 1 && fc.hits == 1);
+    TEST(n0 == n1 && n0 == n2);
+    for(i = 0; i < n0 && same; ++i){
+        same = d0[i].p.x == d2[i].p.x && d0[i].p.y == d2[i].p.y && d0[i].n == d2[i].n &&
+            !memcmp(d0[i].data, d2[i].data, d0[i].n*sizeof(float));
+    }
+    TEST(same);
+    free_descriptors(d1, n1);
+    free_descriptors(d2, n2);
+
+    // Other settings or other pixels are different entries
+    d1 = feature_cache_detect(&fc, im, DETECTOR_HARRIS, 0, 2, .5, 3, &n1);
+    TEST(fc.misses == 2 && n1 < n0);
+    free_descriptors(d1, n1);
+    float v = im.data[0];
+    im.data[0] = 1 - v;
+    d1 = feature_cache_detect(&fc, im, DETECTOR_HARRIS, 0, 2, .3, 3, &n1);
+    TEST(fc.misses == 3);
+    free_descriptors(d1, n1);
+    im.data[0] = v;
+
+    // detect_corners goes through the cache once it is set
+    set_feature_cache(&fc);
+    d1 = detect_corners(im, 2, .3, 3, &n1);
+    set_feature_cache(0);
+    TEST(fc.hits == 2 && n1 == n0);
+    free_descriptors(d1, n1);
+
+    clear_feature_cache(&fc);
+    rmdir("feature_cache_test");
+    free_feature_cache(&fc);
+    free_descriptors(d0, n0);
+    free_image(im);
+}
+
+void test_image_saver()
+{
+    image im = load_image("data/dogsmall.jpg");
+    image_saver *s = make_image_saver(2, 2);
+    int i;
+    char name[64];
+    for(i = 0; i < 5; ++i){
+        sprintf(name, "saver_test%d", i);
+        image_saver_submit(s, copy_image(im), name, 1);
+    }
+    image_saver_submit(s, copy_image(im), "no_such_dir/saver_test", 1);
+    TEST(image_saver_wait(s) == 1);
+    int same = 0;
+    for(i = 0; i < 5; ++i){
+        sprintf(name, "saver_test%d.png", i);
+        image back = load_image(name);
+        same += same_image(im, back);
+        free_image(back);
+        remove(name);
+    }
+    TEST(same == 5);
+    TEST(image_saver_wait(s) == 0);
+
+    // Freeing the saver finishes what is queued
+    image_saver_submit(s, copy_image(im), "saver_test", 0);
+    free_image_saver(s);
+    TEST(access("saver_test.jpg", F_OK) == 0);
+    remove("saver_test.jpg");
+    free_image(im);
+}
+
+void test_stream_encode()
+{
+    image im = load_image("data/dogsmall.jpg");
+    TEST(save_rows(image_rows(&im), "stream_test", 1));
+    image back = load_image("stream_test.png");
+    TEST(same_image(im, back));
+    free_image(back);
+
+    // Odd sizes pad the last JPEG blocks; quality matches save_image
+    image odd = make_image(im.w - 3, im.h - 5, 3);
+    int i, j, k;
+    for(k = 0; k < 3; ++k) for(j = 0; j < odd.h; ++j) for(i = 0; i < odd.w; ++i){
+        set_pixel(odd, i, j, k, get_pixel(im, i, j, k));
+    }
+    TEST(save_rows(image_rows(&odd), "stream_test", 0));
+    back = load_image("stream_test.jpg");
+    TEST(back.w == odd.w && back.h == odd.h && back.c == 3);
+    float diff = 0;
+    for(i = 0; i < odd.w*odd.h*3; ++i) diff += fabsf(back.data[i] - odd.data[i]);
+    TEST(diff/(odd.w*odd.h*3) < .01);
+    free_image(back);
+
+    // Gray and gray + alpha
+    image gray = rgb_to_grayscale(im);
+    TEST(save_rows(image_rows(&gray), "stream_test", 0));
+    back = load_image_stb("stream_test.jpg", 1);
+    TEST(back.c == 1 && back.w == gray.w);
+    diff = 0;
+    for(i = 0; i < gray.w*gray.h; ++i) diff += fabsf(back.data[i] - gray.data[i]);
+    TEST(diff/(gray.w*gray.h) < .01);
+    free_image(back);
+    image ga = make_image(gray.w, gray.h, 2);
+    memcpy(ga.data, gray.data, gray.w*gray.h*sizeof(float));
+    for(i = 0; i < gray.w*gray.h; ++i) ga.data[gray.w*gray.h + i] = (i % 7)/6.;
+    TEST(save_rows(image_rows(&ga), "stream_test", 1));
+    back = load_image_stb("stream_test.png", 2);
+    TEST(same_image(ga, back));
+    free_image(back);
+
+    // Long runs exercise matches across the deflate window
+    canvas cv = make_canvas(3*CANVAS_TILE + 17, 2*CANVAS_TILE + 5, 3, 0);
+    canvas_paste(cv, im, 40, 30);
+    canvas_paste(cv, im, 2*CANVAS_TILE, CANVAS_TILE);
+    TEST(save_canvas_image(cv, "stream_test", 1));
+    image flat = canvas_to_image(cv);
+    back = load_image("stream_test.png");
+    TEST(same_image(flat, back));
+    free_image(back);
+    TEST(save_canvas_image(cv, "stream_test", 0));
+    back = load_image("stream_test.jpg");
+    TEST(back.w == cv.w && back.h == cv.h);
+    free_image(back);
+    free_image(flat);
+    free_canvas(cv);
+
+    remove("stream_test.png");
+    remove("stream_test.jpg");
+    free_image(im); free_image(odd); free_image(gray); free_image(ga);
+}
+
+void test_typed_image()
+{
+    image im = load_image("data/dogsmall.jpg");
+    typed_image u8 = image_to_typed(im, DTYPE_U8);
+    typed_image u16 = image_to_typed(im, DTYPE_U16);
+    typed_image f16 = image_to_typed(im, DTYPE_F16);
+    typed_image f32 = image_to_typed(im, DTYPE_F32);
+    image back = typed_to_image(u8);
+    TEST(same_image(back, im));
+    free_image(back);
+    image b16 = typed_to_image(u16), h16 = typed_to_image(f16);
+    int i;
+    float e16 = 0, eh = 0;
+    for(i = 0; i < im.w*im.h*im.c; ++i){
+        e16 = MAX(e16, fabsf(b16.data[i] - im.data[i]));
+        eh = MAX(eh, fabsf(h16.data[i] - im.data[i]));
+    }
+    TEST(e16 < 1e-4 && eh < 1e-3);
+    free_image(b16); free_image(h16);
+
+    // Loading into u8 keeps the decoder's samples
+    typed_image loaded = load_image_typed("data/dogsmall.jpg", DTYPE_U8);
+    TEST(loaded.c == 3 && !memcmp(loaded.data, u8.data, im.w*im.h*3));
+    free_typed_image(loaded);
+    loaded = load_image_typed("data/missing.jpg", DTYPE_U8);
+    TEST(loaded.data == 0);
+
+    // Kernels match their float versions up to the storage precision
+    image f = make_gaussian_filter(2);
+    image gt = convolve_image(im, f, 1);
+    typed_image t = convolve_typed(f32, f, 1);
+    back = typed_to_image(t);
+    TEST(same_image(back, gt));
+    free_image(back); free_typed_image(t);
+    t = convolve_typed(u8, f, 1);
+    back = typed_to_image(t);
+    TEST(t.dtype == DTYPE_U8 && same_image(back, gt));
+    free_image(back); free_typed_image(t); free_image(gt);
+    gt = convolve_image(im, f, 0);
+    t = convolve_typed(f16, f, 0);
+    back = typed_to_image(t);
+    TEST(t.c == 1 && same_image(back, gt));
+    free_image(back); free_typed_image(t); free_image(gt); free_image(f);
+
+    // Integer types saturate where Lanczos rings past [0, 1]
+    gt = filtered_resize(im, 77, 51, RESIZE_LANCZOS3);
+    clamp_image(gt);
+    t = filtered_resize_typed(u16, 77, 51, RESIZE_LANCZOS3);
+    back = typed_to_image(t);
+    TEST(same_image(back, gt));
+    free_image(back); free_typed_image(t); free_image(gt);
+
+    gt = rgb_to_grayscale(im);
+    t = rgb_to_grayscale_typed(u8);
+    back = typed_to_image(t);
+    TEST(same_image(back, gt));
+    free_image(back); free_typed_image(t); free_image(gt);
+
+    TEST(save_rows(typed_rows(&u8), "typed_test", 1));
+    back = load_image("typed_test.png");
+    TEST(same_image(back, im));
+    remove("typed_test.png");
+    free_image(back);
+
+    free_typed_image(u8); free_typed_image(u16); free_typed_image(f16); free_typed_image(f32);
+    free_image(im);
+}
+
+void test_png_options()
+{
+    image im = load_image("data/dog.jpg");
+    int levels[] = {0, 1, 6, 9};
+    int filters[] = {PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH, PNG_FILTER_ADAPTIVE};
+    int i;
+    for(i = 0; i < 6; ++i){
+        set_png_options(levels[i%4], filters[i], 1);
+        save_png(im, "png_test");
+        image back = load_image("png_test.png");
+        TEST(same_image(im, back));
+        free_image(back);
+    }
+    // Even the fast level compresses a photo well
+    FILE *fp = fopen("png_test.png", "rb");
+    fseek(fp, 0, SEEK_END);
+    long adaptive = ftell(fp);
+    fclose(fp);
+    TEST(adaptive < im.w*im.h*3*3/4);
+
+    // Pieces compressed on separate threads join into one valid stream
+    set_png_options(1, PNG_FILTER_ADAPTIVE, 4);
+    save_png(im, "png_test");
+    image back = load_image("png_test.png");
+    TEST(same_image(im, back));
+    free_image(back);
+    image gray = rgb_to_grayscale(im);
+    set_png_options(6, PNG_FILTER_PAETH, 3);
+    save_png(gray, "png_test");
+    back = load_image_stb("png_test.png", 1);
+    TEST(same_image(gray, back));
+    free_image(back);
+
+    set_png_options(6, PNG_FILTER_ADAPTIVE, 1);
+    remove("png_test.png");
+    free_image(im);
+    free_image(gray);
+}
+
+void test_arena()
+{
+    arena *ar = make_arena(4096);
+    arena *outer = use_arena(ar);
+    matrix m = make_matrix(3, 3);
+    image im = make_image(64, 64, 3);
+    use_arena(outer);
+    image heap = make_image(8, 8, 1);
+    TEST(arena_owns(im.data) && arena_owns(m.data[2]) && !arena_owns(heap.data));
+    TEST(arena_grows(ar) == 1);
+    free_image(im);
+    free_matrix(m);
+    free_image(heap);
+    arena_reset(ar);
+
+    // The same work after a reset fits in the merged block
+    int grows = arena_grows(ar);
+    use_arena(ar);
+    m = make_matrix(3, 3);
+    im = make_image(64, 64, 3);
+    use_arena(outer);
+    TEST(arena_grows(ar) == grows);
+    arena_reset(ar);
+
+    // Stitching with an arena matches the heap and stops growing it
+    image a = load_image("data/Rainier1.png");
+    image b = load_image("data/Rainier2.png");
+    set_debug_output(0, 0);
+    image expected = panorama_image(a, b, 2, 50, 3, 2, 100, 30);
+    set_panorama_arena(ar);
+    image p0 = panorama_image(a, b, 2, 50, 3, 2, 100, 30);
+    grows = arena_grows(ar);
+    image p1 = panorama_image(a, b, 2, 50, 3, 2, 100, 30);
+    set_panorama_arena(0);
+    set_debug_output(1, 0);
+    TEST(same_image(expected, p0) && same_image(expected, p1));
+    TEST(arena_grows(ar) == grows);
+    TEST(!arena_owns(p1.data));
+    // Detection temporaries are rewound, the arena holds the live peak and
+    // not every image the stitch ever made
+    TEST(arena_size(ar) < 10*(size_t)a.w*a.h*a.c*sizeof(float));
+    free_image(expected);
+    free_image(p0);
+    free_image(p1);
+    free_image(a);
+    free_image(b);
+
+    // Freeing the latest allocation hands it back, and a rewind gives back
+    // everything since the mark
+    use_arena(ar);
+    size_t size = arena_size(ar);
+    arena_pos mark = arena_mark();
+    image t0 = make_image(32, 32, 1);
+    image t1 = make_image(32, 32, 1);
+    free_image(t1);
+    image t2 = make_image(32, 32, 1);
+    TEST(t2.data == t1.data);
+    free_image(t0);
+    arena_rewind(mark);
+    image t3 = make_image(32, 32, 1);
+    TEST(t3.data == t0.data);
+    arena_rewind(mark);
+
+    // Thousands of RANSAC iterations run in the same memory
+    int n = 64, i;
+    match *ms = arena_calloc(n, sizeof(match));
+    for(i = 0; i < n; ++i){
+        ms[i].p = make_point(17*i % 101, 31*i % 97);
+        ms[i].q = make_point(ms[i].p.x + 5 + .01*ms[i].p.y, ms[i].p.y - 3);
+    }
+    mark = arena_mark();
+    matrix H = RANSAC(ms, n, 2, 50000, n);
+    TEST(arena_size(ar) == size);
+    free_matrix(H);
+    arena_rewind(mark);
+    use_arena(outer);
+    arena_reset(ar);
+    free_arena(ar);
+}
+
+void test_padded_image()
+{
+    image im = load_image("data/dogsmall.jpg");
+    image p = pad_image(im, 4);
+    int aligned = 1, x, y, k;
+    for(k = 0; k < p.c; ++k){
+        for(y = 0; y < p.h; ++y) aligned &= ((size_t)&IMAGE_AT(p, 0, y, k) & 63) == 0;
+    }
+    TEST(aligned && p.stride % 16 == 0 && p.stride >= p.w + 8);
+    TEST(((size_t)im.data & 63) == 0);
+    int border = 1;
+    for(k = 0; k < p.c; ++k){
+        for(y = -4; y < p.h + 4; ++y){
+            for(x = -4; x < p.w + 4; ++x){
+                border &= IMAGE_AT(p, x, y, k) == get_pixel(im, x, y, k);
+            }
+        }
+    }
+    TEST(border);
+    image c = copy_image(p);
+    TEST(same_image(c, im));
+    TEST(get_pixel(p, 5, 7, 2) == get_pixel(im, 5, 7, 2));
+
+    // Convolving an image that already has a wide enough border reads it in
+    // place, the only allocation is the result
+    image f = make_gaussian_filter(1);
+    image gt = convolve_image(im, f, 1);
+    arena *ar = make_arena(4*(size_t)im.w*im.h*im.c*sizeof(float));
+    arena *outer = use_arena(ar);
+    arena_pos before = arena_mark();
+    image blur = convolve_image(p, f, 1);
+    arena_pos after = arena_mark();
+    use_arena(outer);
+    TEST(arena_grows(ar) == 0 && after.block == before.block);
+    TEST(after.used - before.used <= 64 + (size_t)im.w*im.h*im.c*sizeof(float) + 64);
+    TEST(same_image(blur, gt));
+    free_arena(ar);
+    free_image(gt);
+    free_image(f);
+
+    // Power of two widths get a stride that isn't
+    image q = make_padded_image(512, 8, 1, 0);
+    TEST(q.stride % 512 != 0);
+    free_image(q);
+    free_image(c);
+    free_image(p);
+    free_image(im);
+}
+
+void test_image_view()
+{
+    image im = load_image("data/dogsmall.jpg");
+    image v = image_view(im, 10, 20, 51, 40);
+    image crop = make_image(51, 40, 3);
+    int x, y, k;
+    for(k = 0; k < 3; ++k){
+        for(y = 0; y < 40; ++y){
+            for(x = 0; x < 51; ++x) set_pixel(crop, x, y, k, get_pixel(im, x+10, y+20, k));
+        }
+    }
+    image c = copy_image(v);
+    TEST(same_image(c, crop));
+    free_image(c);
+
+    // Kernels read views like the packed crop
+    image f = make_gaussian_filter(1);
+    image a = convolve_image(v, f, 1);
+    image b = convolve_image(crop, f, 1);
+    TEST(same_image(a, b));
+    free_image(a); free_image(b); free_image(f);
+    a = filtered_resize(v, 23, 17, RESIZE_LANCZOS3);
+    b = filtered_resize(crop, 23, 17, RESIZE_LANCZOS3);
+    TEST(same_image(a, b));
+    free_image(a); free_image(b);
+    a = harris_response(v, 2);
+    b = harris_response(crop, 2);
+    TEST(same_image(a, b));
+    free_image(a); free_image(b);
+    a = pyramid_reduce(v);
+    b = pyramid_reduce(crop);
+    TEST(same_image(a, b));
+    free_image(a); free_image(b);
+    save_png(v, "view_test");
+    a = load_image("view_test.png");
+    TEST(same_image(a, crop));
+    free_image(a);
+    save_image(v, "view_test");
+    a = load_image("view_test.jpg");
+    save_image(crop, "view_test");
+    b = load_image("view_test.jpg");
+    TEST(same_image(a, b));
+    free_image(a); free_image(b);
+    remove("view_test.png");
+    remove("view_test.jpg");
+
+    // Writes land in the parent, and kernels can write into views
+    set_pixel(v, 0, 0, 1, .25f);
+    TEST(get_pixel(im, 10, 20, 1) == .25f);
+    image both = both_images(im, crop);
+    TEST(same_image(image_view(both, 0, 0, im.w, im.h), im));
+    TEST(same_image(image_view(both, im.w, 0, 51, 40), crop));
+    TEST(get_pixel(both, im.w, 40, 0) == 0);
+    image half = make_image(im.w, (im.h+1)/2*2, 3);
+    pyramid_reduce_into(im, image_view(half, 0, 0, (im.w+1)/2, (im.h+1)/2));
+    a = pyramid_reduce(im);
+    TEST(same_image(image_view(half, 0, 0, a.w, a.h), a));
+    free_image(a);
+    free_image(half);
+    free_image(both);
+    free_image(crop);
+    free_image(im);
+}
+
 void run_tests()
 {
     //test_matrix();
+    test_load_channels();
+    test_image_writer();
+    test_load_scaled();
+    test_image_loader();
+    test_raw_image();
+    test_image_saver();
+    test_stream_encode();
+    test_png_options();
+    test_typed_image();
+    test_padded_image();
+    test_image_view();
     test_get_pixel();
     test_set_pixel();
     test_copy();
@@ -397,6 +1414,8 @@ void run_tests()
     test_nn_resize();
     test_bl_resize();
     test_multiple_resize();
+    test_filtered_resize();
+    test_u8_resize();
     test_gaussian_filter();
     test_sharpen_filter();
     test_emboss_filter();
@@ -408,6 +1427,18 @@ void run_tests()
     test_sobel();
     test_structure();
     test_cornerness();
+    test_harris_response();
+    test_multiscale_harris();
+    test_fast_corners();
+    test_subpixel_corners();
+    test_feature_cache();
+    test_arena();
+    test_least_squares();
+    test_combine_images();
+    test_canvas();
+    test_cylindrical();
+    test_pyramid();
+    test_blend();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 
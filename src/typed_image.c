@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+#include "stb_image.h"
+
+// Images stored as u8, u16, f16 or f32 samples. Kernels work on them a row
+// at a time: typed_get_row widens one row of one channel to float and
+// typed_set_row narrows it back, so only a few rows ever exist as float.
+// Each dtype gets its own constant-stride conversion loop.
+
+static size_t dtype_size(int dtype)
+{
+    if(dtype == DTYPE_U8) return 1;
+    if(dtype == DTYPE_U16 || dtype == DTYPE_F16) return 2;
+    return 4;
+}
+
+typed_image make_typed_image(int w, int h, int c, int dtype)
+{
+    typed_image im = {w, h, c, dtype, 0};
+    im.data = calloc((size_t)w*h*c, dtype_size(dtype));
+    return im;
+}
+
+void free_typed_image(typed_image im)
+{
+    free(im.data);
+}
+
+// Read one row of one channel as floats. Integer types map their full
+// range to [0, 1].
+// int y: row to read.
+// int c: channel to read.
+// float *row: im.w floats to fill in.
+void typed_get_row(typed_image im, int y, int c, float *row)
+{
+    size_t off = (size_t)c*im.w*im.h + (size_t)y*im.w;
+    int i;
+    if(im.dtype == DTYPE_U8){
+        const unsigned char *s = (const unsigned char *)im.data + off;
+        for(i = 0; i < im.w; ++i) row[i] = s[i]*(1.f/255);
+    } else if(im.dtype == DTYPE_U16){
+        const unsigned short *s = (const unsigned short *)im.data + off;
+        for(i = 0; i < im.w; ++i) row[i] = s[i]*(1.f/65535);
+    } else if(im.dtype == DTYPE_F16){
+        const unsigned short *s = (const unsigned short *)im.data + off;
+        for(i = 0; i < im.w; ++i) row[i] = half_to_float(s[i]);
+    } else {
+        memcpy(row, (const float *)im.data + off, im.w*sizeof(float));
+    }
+}
+
+// Write one row of one channel from floats. Integer types clamp to [0, 1]
+// and round, so signed results like gradients need F16 or F32.
+// int y: row to write.
+// int c: channel to write.
+// const float *row: im.w floats.
+void typed_set_row(typed_image im, int y, int c, const float *row)
+{
+    size_t off = (size_t)c*im.w*im.h + (size_t)y*im.w;
+    int i;
+    if(im.dtype == DTYPE_U8){
+        unsigned char *d = (unsigned char *)im.data + off;
+        for(i = 0; i < im.w; ++i) d[i] = (unsigned char)(MIN(MAX(row[i], 0.f), 1.f)*255 + .5f);
+    } else if(im.dtype == DTYPE_U16){
+        unsigned short *d = (unsigned short *)im.data + off;
+        for(i = 0; i < im.w; ++i) d[i] = (unsigned short)(MIN(MAX(row[i], 0.f), 1.f)*65535 + .5f);
+    } else if(im.dtype == DTYPE_F16){
+        unsigned short *d = (unsigned short *)im.data + off;
+        for(i = 0; i < im.w; ++i) d[i] = float_to_half(row[i]);
+    } else {
+        memcpy((float *)im.data + off, row, im.w*sizeof(float));
+    }
+}
+
+// Convert an image to another storage type.
+// int dtype: DTYPE_U8, DTYPE_U16, DTYPE_F16 or DTYPE_F32.
+// returns: new typed image, values converted like typed_set_row.
+typed_image image_to_typed(image im, int dtype)
+{
+    typed_image t = make_typed_image(im.w, im.h, im.c, dtype);
+    int y, k;
+    for(k = 0; k < im.c; ++k){
+        for(y = 0; y < im.h; ++y){
+            typed_set_row(t, y, k, &IMAGE_AT(im, 0, y, k));
+        }
+    }
+    return t;
+}
+
+// Convert a typed image back to a float image.
+image typed_to_image(typed_image t)
+{
+    image im = make_image(t.w, t.h, t.c);
+    int y, k;
+    for(k = 0; k < t.c; ++k){
+        for(y = 0; y < t.h; ++y){
+            typed_get_row(t, y, k, &IMAGE_AT(im, 0, y, k));
+        }
+    }
+    return im;
+}
+
+static void typed_get_row_source(void *data, int y, int c, float *row)
+{
+    typed_get_row(*(typed_image *)data, y, c, row);
+}
+
+// Rows of a typed image, for the streaming encoders.
+// typed_image *im: image to read, must outlive the source.
+row_source typed_rows(typed_image *im)
+{
+    row_source src = {im->w, im->h, im->c, im, typed_get_row_source};
+    return src;
+}
+
+// Load an image straight into a storage type. U8 and U16 are filled from
+// the decoder's own samples, without a float copy of the image. Alpha is
+// dropped like load_image.
+// char *filename: file to load.
+// int dtype: storage type of the result.
+// returns: the image, with data == 0 if the file could not be loaded.
+typed_image load_image_typed(char *filename, int dtype)
+{
+    typed_image im = {0, 0, 0, dtype, 0};
+    int w, h, c;
+    void *pixels = dtype == DTYPE_U16 ? (void *)stbi_load_16(filename, &w, &h, &c, 0)
+                                      : (void *)stbi_load(filename, &w, &h, &c, 0);
+    if(!pixels){
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n", filename, stbi_failure_reason());
+        return im;
+    }
+    int keep = c == 4 ? 3 : c;
+    im = make_typed_image(w, h, keep, dtype);
+    size_t n = (size_t)w*h;
+    size_t i;
+    int k;
+    if(dtype == DTYPE_U8){
+        const unsigned char *s = pixels;
+        unsigned char *d = im.data;
+        for(k = 0; k < keep; ++k) for(i = 0; i < n; ++i) d[k*n + i] = s[i*c + k];
+    } else if(dtype == DTYPE_U16){
+        const unsigned short *s = pixels;
+        unsigned short *d = im.data;
+        for(k = 0; k < keep; ++k) for(i = 0; i < n; ++i) d[k*n + i] = s[i*c + k];
+    } else {
+        const unsigned char *s = pixels;
+        float *row = malloc(w*sizeof(float));
+        int x, y;
+        for(k = 0; k < keep; ++k){
+            for(y = 0; y < h; ++y){
+                const unsigned char *p = s + ((size_t)y*w)*c + k;
+                for(x = 0; x < w; ++x) row[x] = p[x*c]*(1.f/255);
+                typed_set_row(im, y, k, row);
+            }
+        }
+        free(row);
+    }
+    stbi_image_free(pixels);
+    return im;
+}
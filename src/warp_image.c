@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#include "matrix.h"
+
+// Output is processed in square tiles so each one can be culled against the
+// source footprint and handed to a different thread.
+#define WARP_TILE 64
+
+// Projects the point (x, y) with H, in double precision.
+// returns: 1 if the point lands in front of the camera (w > 0), 0 otherwise.
+static int warp_project(const double h[9], double x, double y, double *u, double *v)
+{
+    double w = h[6]*x + h[7]*y + h[8];
+    if(w <= 0) return 0;
+    *u = (h[0]*x + h[1]*y + h[2])/w;
+    *v = (h[3]*x + h[4]*y + h[5])/w;
+    return 1;
+}
+
+// Checks whether a tile of the output can possibly sample the source.
+// A homography maps the tile to the quad spanned by its projected corners
+// as long as all of them have positive w, so if every corner is off the same
+// side of the source the whole tile is.
+// returns: 0 if the tile certainly misses src, 1 if it might hit.
+static int warp_tile_hits(const double h[9], image src, int x0, int y0, int x1, int y1)
+{
+    double u[4], v[4];
+    if(!warp_project(h, x0, y0, u+0, v+0)) return 1;
+    if(!warp_project(h, x1, y0, u+1, v+1)) return 1;
+    if(!warp_project(h, x0, y1, u+2, v+2)) return 1;
+    if(!warp_project(h, x1, y1, u+3, v+3)) return 1;
+    int i;
+    int left = 0, right = 0, above = 0, below = 0;
+    for(i = 0; i < 4; ++i){
+        left  += u[i] < 0;
+        right += u[i] >= src.w;
+        above += v[i] < 0;
+        below += v[i] >= src.h;
+    }
+    return !(left == 4 || right == 4 || above == 4 || below == 4);
+}
+
+// Warps one rectangle of the output.
+// The projective coordinates along a row are the row start plus i times the
+// first column of H, so there is no per-pixel matrix product. Source offsets
+// and weights for the row are computed once, then every channel is blended
+// with a branch-free gather the compiler can vectorize.
+// float *dst: top left output pixel of the rectangle.
+// int stride: floats between output rows.
+// int plane: floats between output channels.
+// float *mask: if not 0, set to 1 (same layout as one channel of dst)
+//              wherever src was sampled.
+// int ox, oy: coordinates of the rectangle in the warp's input space.
+void warp_rect(image src, matrix H, float *dst, int stride, int plane, float *mask,
+        int ox, int oy, int tw, int th)
+{
+    assert(H.rows == 3 && H.cols == 3);
+    double h[9];
+    int i, j, k;
+    for(i = 0; i < 9; ++i) h[i] = H.data[i/3][i%3];
+
+    int sw = src.w;
+    int sh = src.h;
+    int sstride = IMAGE_STRIDE(src);
+
+    int off[WARP_TILE];
+    int offx[WARP_TILE];
+    int offy[WARP_TILE];
+    float fx[WARP_TILE];
+    float fy[WARP_TILE];
+    float valid[WARP_TILE];
+
+    for(i = 0; i < tw; i += WARP_TILE){
+        int n = MIN(WARP_TILE, tw - i);
+        for(j = 0; j < th; ++j){
+            double x = ox + i;
+            double y = oy + j;
+            double X0 = h[0]*x + h[1]*y + h[2];
+            double Y0 = h[3]*x + h[4]*y + h[5];
+            double W0 = h[6]*x + h[7]*y + h[8];
+            int any = 0;
+            for(k = 0; k < n; ++k){
+                double W = W0 + k*h[6];
+                double u = (X0 + k*h[0])/W;
+                double v = (Y0 + k*h[3])/W;
+                int in = W > 0 && u >= 0 && u < sw && v >= 0 && v < sh;
+                int ix = in ? (int)u : 0;
+                int iy = in ? (int)v : 0;
+                off[k] = iy*sstride + ix;
+                offx[k] = ix+1 < sw;
+                offy[k] = iy+1 < sh ? sstride : 0;
+                fx[k] = in ? u - ix : 0;
+                fy[k] = in ? v - iy : 0;
+                valid[k] = in;
+                any |= in;
+            }
+            if(!any) continue;
+            if(mask){
+                float *m = mask + j*stride + i;
+                for(k = 0; k < n; ++k) m[k] = valid[k] ? 1 : m[k];
+            }
+            for(int c = 0; c < src.c; ++c){
+                const float *s = &IMAGE_AT(src, 0, 0, c);
+                float *d = dst + c*plane + j*stride + i;
+                for(k = 0; k < n; ++k){
+                    const float *p = s + off[k];
+                    float top = p[0] + fx[k]*(p[offx[k]] - p[0]);
+                    float bot = p[offy[k]] + fx[k]*(p[offy[k] + offx[k]] - p[offy[k]]);
+                    float val = top + fy[k]*(bot - top);
+                    d[k] = valid[k] ? val : d[k];
+                }
+            }
+        }
+    }
+}
+
+// Warps an image into another one through a homography.
+// Output pixel (x, y) samples src bilinearly at H*(x+dx, y+dy), pixels that
+// project outside of src are left as they are. Tiles run in parallel when
+// built with OPENMP=1.
+// image dst: image to write into, should have as many channels as src.
+// image src: image to sample.
+// matrix H: homography from the shifted dst coordinates into src.
+// int dx, dy: offset added to dst coordinates before projecting.
+void warp_image_into(image dst, image src, matrix H, int dx, int dy)
+{
+    assert(dst.c >= src.c);
+    double h[9];
+    int i;
+    for(i = 0; i < 9; ++i) h[i] = H.data[i/3][i%3];
+
+    int tx = (dst.w + WARP_TILE - 1)/WARP_TILE;
+    int ty = (dst.h + WARP_TILE - 1)/WARP_TILE;
+    int t;
+    #pragma omp parallel for schedule(dynamic)
+    for(t = 0; t < tx*ty; ++t){
+        int x0 = (t%tx)*WARP_TILE;
+        int y0 = (t/tx)*WARP_TILE;
+        int tw = MIN(WARP_TILE, dst.w - x0);
+        int th = MIN(WARP_TILE, dst.h - y0);
+        if(!warp_tile_hits(h, src, x0+dx, y0+dy, x0+dx+tw-1, y0+dy+th-1)) continue;
+        warp_rect(src, H, &IMAGE_AT(dst, x0, y0, 0), IMAGE_STRIDE(dst), IMAGE_PLANE(dst), 0,
+                x0+dx, y0+dy, tw, th);
+    }
+}
+
+// Warps an image into a tiled canvas, same as warp_image_into.
+// Only canvas tiles that src can reach are touched, so tiles outside the
+// footprint of src stay unallocated.
+void warp_canvas_into(canvas cv, image src, matrix H, int dx, int dy)
+{
+    assert(cv.c >= src.c);
+    double h[9];
+    int i;
+    for(i = 0; i < 9; ++i) h[i] = H.data[i/3][i%3];
+
+    int t;
+    #pragma omp parallel for schedule(dynamic)
+    for(t = 0; t < cv.tw*cv.th; ++t){
+        int tx = t%cv.tw;
+        int ty = t/cv.tw;
+        int x0 = tx*CANVAS_TILE;
+        int y0 = ty*CANVAS_TILE;
+        int tw = MIN(CANVAS_TILE, cv.w - x0);
+        int th = MIN(CANVAS_TILE, cv.h - y0);
+        if(!warp_tile_hits(h, src, x0+dx, y0+dy, x0+dx+tw-1, y0+dy+th-1)) continue;
+        float *tile = canvas_tile(cv, tx, ty);
+        warp_rect(src, H, tile, CANVAS_TILE, CANVAS_TILE*CANVAS_TILE, 0,
+                x0+dx, y0+dy, tw, th);
+    }
+}
+
+void free_remap(remap m)
+{
+    free(m.off);
+    free(m.fx);
+    free(m.fy);
+}
+
+// Build the lookup for a cylindrical projection. All of the trig happens
+// here, once per (w, h, f), applying the remap is only a gather.
+// int w, h: size of the images to project.
+// float f: focal length used to take the images (in pixels).
+// returns: remap from the flattened cylinder back into the image.
+remap make_cylindrical_remap(int w, int h, float f)
+{
+    assert(w > 1 && h > 1);
+    remap m;
+    m.w = w;
+    m.h = h;
+    m.off = calloc(w*h, sizeof(unsigned int));
+    m.fx = calloc(w*h, sizeof(unsigned short));
+    m.fy = calloc(w*h, sizeof(unsigned short));
+    float xc = w/2;
+    float yc = h/2;
+    int x, y;
+    #pragma omp parallel for private(x)
+    for(y = 0; y < h; ++y){
+        float hh = (y - yc)/f;
+        for(x = 0; x < w; ++x){
+            float theta = (x - xc)/f;
+            float Z = cosf(theta);
+            float u = f*sinf(theta)/Z + xc;
+            float v = f*hh/Z + yc;
+            int i = y*w + x;
+            if(Z <= 0 || u < 0 || u > w-1 || v < 0 || v > h-1){
+                m.off[i] = REMAP_NONE;
+                continue;
+            }
+            // Keep both samples inside the image, the far one gets weight 1
+            int ix = MIN((int)u, w-2);
+            int iy = MIN((int)v, h-2);
+            m.off[i] = iy*w + ix;
+            m.fx[i] = lrintf((u - ix)*32768);
+            m.fy[i] = lrintf((v - iy)*32768);
+        }
+    }
+    return m;
+}
+
+// Apply a remap to an image.
+// image im: source image, must be m.w x m.h.
+// image out: m.w x m.h image with as many channels as im to write into.
+//            Pixels without a source are set to 0.
+void remap_image_into(remap m, image im, image out)
+{
+    assert(im.w == m.w && im.h == m.h);
+    assert(out.w == m.w && out.h == m.h && out.c >= im.c);
+    int w = m.w;
+    int n = m.w*m.h;
+    int c, y;
+    // The offsets in the remap are into packed channels
+    image src = IMAGE_PACKED(im) ? im : copy_image(im);
+    for(c = 0; c < im.c; ++c){
+        const float *s = src.data + c*n;
+        #pragma omp parallel for
+        for(y = 0; y < m.h; ++y){
+            float *d = &IMAGE_AT(out, 0, y, c);
+            const unsigned int *off = m.off + y*w;
+            const unsigned short *fx = m.fx + y*w;
+            const unsigned short *fy = m.fy + y*w;
+            int i;
+            for(i = 0; i < w; ++i){
+                int valid = off[i] != REMAP_NONE;
+                const float *p = s + (valid ? off[i] : 0);
+                float wx = fx[i]*(1.f/32768);
+                float wy = fy[i]*(1.f/32768);
+                float top = p[0] + wx*(p[1] - p[0]);
+                float bot = p[w] + wx*(p[w+1] - p[w]);
+                float v = top + wy*(bot - top);
+                d[i] = valid ? v : 0;
+            }
+        }
+    }
+    if(src.data != im.data) free_image(src);
+}
+
+// Apply a remap to an image.
+// returns: new image with the remapped pixels.
+image remap_image(remap m, image im)
+{
+    image out = make_image(im.w, im.h, im.c);
+    remap_image_into(m, im, out);
+    return out;
+}
@@ -14,7 +14,10 @@ class IMAGE(Structure):
     _fields_ = [("w", c_int),
                 ("h", c_int),
                 ("c", c_int),
-                ("data", POINTER(c_float))]
+                ("data", POINTER(c_float)),
+                ("stride", c_int),
+                ("pad", c_int),
+                ("plane", c_size_t)]
     def __add__(self, other):
         return add_image(self, other)
     def __sub__(self, other):
@@ -26,6 +29,7 @@ class POINT(Structure):
 
 class DESCRIPTOR(Structure):
     _fields_ = [("p", POINT),
+                ("scale", c_float),
                 ("n", c_int),
                 ("data", POINTER(c_float))]
 
@@ -60,6 +64,14 @@ copy_image = lib.copy_image
 copy_image.argtypes = [IMAGE]
 copy_image.restype = IMAGE
 
+copy_image_into = lib.copy_image_into
+copy_image_into.argtypes = [IMAGE, IMAGE]
+copy_image_into.restype = None
+
+image_view = lib.image_view
+image_view.argtypes = [IMAGE, c_int, c_int, c_int, c_int]
+image_view.restype = IMAGE
+
 rgb_to_hsv = lib.rgb_to_hsv
 rgb_to_hsv.argtypes = [IMAGE]
 rgb_to_hsv.restype = None
@@ -87,6 +99,13 @@ load_image_lib.restype = IMAGE
 def load_image(f):
     return load_image_lib(f.encode('ascii'))
 
+load_image_scaled_lib = lib.load_image_scaled
+load_image_scaled_lib.argtypes = [c_char_p, c_int]
+load_image_scaled_lib.restype = IMAGE
+
+def load_image_scaled(f, denom):
+    return load_image_scaled_lib(f.encode('ascii'), denom)
+
 save_png_lib = lib.save_png
 save_png_lib.argtypes = [IMAGE, c_char_p]
 save_png_lib.restype = None
@@ -101,6 +120,20 @@ save_image_lib.restype = None
 def save_image(im, f):
     return save_image_lib(im, f.encode('ascii'))
 
+PNG_FILTER_NONE = 0
+PNG_FILTER_SUB = 1
+PNG_FILTER_UP = 2
+PNG_FILTER_AVG = 3
+PNG_FILTER_PAETH = 4
+PNG_FILTER_ADAPTIVE = 5
+
+set_png_options_lib = lib.set_png_options
+set_png_options_lib.argtypes = [c_int, c_int, c_int]
+set_png_options_lib.restype = None
+
+def set_png_options(level=6, filter=PNG_FILTER_ADAPTIVE, threads=1):
+    set_png_options_lib(level, filter, threads)
+
 same_image = lib.same_image
 same_image.argtypes = [IMAGE, IMAGE]
 same_image.restype = c_int
@@ -169,6 +202,33 @@ mark_corners = lib.mark_corners
 mark_corners.argtypes = [IMAGE, POINTER(DESCRIPTOR), c_int]
 mark_corners.restype = None
 
+DETECTOR_HARRIS = 0
+DETECTOR_FAST9 = 1
+DETECTOR_FAST12 = 2
+
+set_corner_detector_lib = lib.set_corner_detector
+set_corner_detector_lib.argtypes = [c_int, c_float]
+set_corner_detector_lib.restype = None
+
+def set_corner_detector(detector, fast_thresh=.1):
+    set_corner_detector_lib(detector, fast_thresh)
+
+class FEATURE_CACHE(Structure):
+    _fields_ = [("dir", c_char_p),
+                ("hits", c_int),
+                ("misses", c_int)]
+
+make_feature_cache_lib = lib.make_feature_cache
+make_feature_cache_lib.argtypes = [c_char_p]
+make_feature_cache_lib.restype = FEATURE_CACHE
+
+def make_feature_cache(d):
+    return make_feature_cache_lib(d.encode('ascii'))
+
+set_feature_cache = lib.set_feature_cache
+set_feature_cache.argtypes = [POINTER(FEATURE_CACHE)]
+set_feature_cache.restype = None
+
 detect_and_draw_corners = lib.detect_and_draw_corners
 detect_and_draw_corners.argtypes = [IMAGE, c_float, c_float, c_int]
 detect_and_draw_corners.restype = None
@@ -189,6 +249,17 @@ panorama_image_lib = lib.panorama_image
 panorama_image_lib.argtypes = [IMAGE, IMAGE, c_float, c_float, c_int, c_float, c_int, c_int]
 panorama_image_lib.restype = IMAGE
 
+set_debug_output_lib = lib.set_debug_output
+set_debug_output_lib.argtypes = [c_int, c_void_p]
+set_debug_output_lib.restype = None
+
+def set_debug_output(on):
+    set_debug_output_lib(on, None)
+
+set_panorama_levels = lib.set_panorama_levels
+set_panorama_levels.argtypes = [c_int]
+set_panorama_levels.restype = None
+
 def panorama_image(a, b, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30):
     return panorama_image_lib(a, b, sigma, thresh, nms, inlier_thresh, iters, cutoff)
 